@@ -1,5 +1,5 @@
 #if defined(__linux__) && !defined(_GNU_SOURCE)
-#define _GNU_SOURCE // accept4, recvmmsg, sendmmsg
+#define _GNU_SOURCE // accept4, recvmmsg, sendmmsg, statx
 #endif
 
 #include "cone.h"
@@ -7,8 +7,13 @@
 
 #include <fcntl.h>
 
+#if CONE_EV_URING
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#endif
+
 #if __APPLE__
-#define cold_retryable(e, w) ((e) == EWOULDBLOCK || (e) == EAGAIN || ((w) && errno == EPROTOTYPE))
+#define cold_retryable(e, w) ((e) == EWOULDBLOCK || (e) == EAGAIN || ((w) & CONE_IO_WRITE && errno == EPROTOTYPE))
 #else
 #define cold_retryable(e, w) ((e) == EWOULDBLOCK || (e) == EAGAIN)
 #endif
@@ -21,19 +26,90 @@
     return __r;                              \
 }
 
+#define cold_unparen(...) __VA_ARGS__
+
+#if CONE_EV_URING
+// Whether an fd is blocking is checked once and remembered until `cold_close`, so that
+// reads and writes on sockets do not cost an extra `fcntl` each. Fds too large for this
+// table are checked every time.
+enum { COLD_FD_UNKNOWN, COLD_FD_BLOCKING, COLD_FD_NONBLOCKING };
+
+static CONE_ATOMIC(unsigned char) cold_fd_modes[65536];
+
+static void cold_remember(int fd, int mode) {
+    if ((size_t)fd < sizeof(cold_fd_modes) / sizeof(*cold_fd_modes))
+        atomic_store_explicit(&cold_fd_modes[fd], mode, memory_order_relaxed);
+}
+
+static int cold_blocking(int fd) {
+    int mode = (size_t)fd < sizeof(cold_fd_modes) / sizeof(*cold_fd_modes)
+             ? atomic_load_explicit(&cold_fd_modes[fd], memory_order_relaxed) : COLD_FD_UNKNOWN;
+    if (mode == COLD_FD_UNKNOWN) {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags == -1)
+            return 0;
+        cold_remember(fd, mode = flags & O_NONBLOCK ? COLD_FD_NONBLOCKING : COLD_FD_BLOCKING);
+    }
+    return mode == COLD_FD_BLOCKING;
+}
+
+// Readiness means nothing for regular files, and blocking fds never return EAGAIN anyway,
+// so for them the operation itself goes to the loop's io_uring. If the kernel does not
+// support it, fall back to doing the syscall.
+static int cold_ioring(const struct io_uring_sqe *sqe, ssize_t *r) {
+    int res;
+    if (!cone)
+        return 0;
+    if (cone_ioring(sqe, &res))
+        return *r = -1, 1;
+    if (res == -EINVAL || res == -EOPNOTSUPP)
+        return 0;
+    if (res == -EAGAIN)
+        // The fd is non-blocking after all, e.g. it was reused after a plain `close`.
+        return cold_remember(sqe->fd, COLD_FD_NONBLOCKING), 0;
+    return *r = res < 0 ? (errno = -res, -1) : res, 1;
+}
+
+#define cold_iofile(cond, sqe, call) {                                                        \
+    ssize_t __c;                                                                              \
+    if ((cond) && cold_ioring(&(struct io_uring_sqe){cold_unparen sqe}, &__c)) return __c;   \
+    call                                                                                      \
+}
+#else
+#define cold_iofile(cond, sqe, call) call
+#endif
+
 int cold_unblock(int fd) {
     int flags = fcntl(fd, F_GETFL);
-    return flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) MUN_RETHROW_OS;
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) MUN_RETHROW_OS)
+        return -1;
+    #if CONE_EV_URING
+        cold_remember(fd, COLD_FD_NONBLOCKING);
+    #endif
+    return 0;
+}
+
+int cold_close(int fd) {
+    // If this fails, someone is still waiting on the fd, which is a bug anyway.
+    if (cone)
+        cone_fd_unregister(fd);
+    #if CONE_EV_URING
+        cold_remember(fd, COLD_FD_UNKNOWN);
+    #endif
+    return close(fd);
 }
 
 ssize_t cold_read(int fd, void *buf, size_t count)
-    cold_iocall(fd, 0, read, fd, buf, count)
+    cold_iofile(cold_blocking(fd), (.opcode = IORING_OP_READ, .fd = fd, .addr = (uintptr_t)buf, .len = count, .off = -1),
+        cold_iocall(fd, 0, read, fd, buf, count))
 
 ssize_t cold_pread(int fd, void *buf, size_t count, off_t offset)
-    cold_iocall(fd, 0, pread, fd, buf, count, offset)
+    cold_iofile(1, (.opcode = IORING_OP_READ, .fd = fd, .addr = (uintptr_t)buf, .len = count, .off = offset),
+        cold_iocall(fd, 0, pread, fd, buf, count, offset))
 
 ssize_t cold_readv(int fd, const struct iovec *iov, int iovcnt)
-    cold_iocall(fd, 0, readv, fd, iov, iovcnt)
+    cold_iofile(cold_blocking(fd), (.opcode = IORING_OP_READV, .fd = fd, .addr = (uintptr_t)iov, .len = iovcnt, .off = -1),
+        cold_iocall(fd, 0, readv, fd, iov, iovcnt))
 
 ssize_t cold_recv(int fd, void *buf, size_t len, int flags)
     cold_iocall(fd, 0, recv, fd, buf, len, flags)
@@ -45,13 +121,16 @@ ssize_t cold_recvmsg(int fd, struct msghdr *msg, int flags)
     cold_iocall(fd, 0, recvmsg, fd, msg, flags)
 
 ssize_t cold_write(int fd, const void *buf, size_t count)
-    cold_iocall(fd, 1, write, fd, buf, count)
+    cold_iofile(cold_blocking(fd), (.opcode = IORING_OP_WRITE, .fd = fd, .addr = (uintptr_t)buf, .len = count, .off = -1),
+        cold_iocall(fd, 1, write, fd, buf, count))
 
 ssize_t cold_pwrite(int fd, const void *buf, size_t count, off_t offset)
-    cold_iocall(fd, 1, pwrite, fd, buf, count, offset)
+    cold_iofile(1, (.opcode = IORING_OP_WRITE, .fd = fd, .addr = (uintptr_t)buf, .len = count, .off = offset),
+        cold_iocall(fd, 1, pwrite, fd, buf, count, offset))
 
 ssize_t cold_writev(int fd, const struct iovec *iov, int iovcnt)
-    cold_iocall(fd, 1, writev, fd, iov, iovcnt)
+    cold_iofile(cold_blocking(fd), (.opcode = IORING_OP_WRITEV, .fd = fd, .addr = (uintptr_t)iov, .len = iovcnt, .off = -1),
+        cold_iocall(fd, 1, writev, fd, iov, iovcnt))
 
 ssize_t cold_send(int fd, const void *buf, size_t len, int flags)
     cold_iocall(fd, 1, send, fd, buf, len, flags)
@@ -62,6 +141,13 @@ ssize_t cold_sendto(int fd, const void *buf, size_t len, int flags, const struct
 ssize_t cold_sendmsg(int fd, const struct msghdr *msg, int flags)
     cold_iocall(fd, 1, sendmsg, fd, msg, flags)
 
+int cold_fsync(int fd)
+    cold_iofile(1, (.opcode = IORING_OP_FSYNC, .fd = fd), { return fsync(fd); })
+
+int cold_openat(int dirfd, const char *path, int flags, mode_t mode)
+    cold_iofile(1, (.opcode = IORING_OP_OPENAT, .fd = dirfd, .addr = (uintptr_t)path, .len = mode, .open_flags = flags),
+        { return openat(dirfd, path, flags, mode); })
+
 int cold_listen(int fd, int backlog) {
     return cone && cold_unblock(fd) ? -1 : listen(fd, backlog);
 }
@@ -81,20 +167,36 @@ int cold_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
 }
 
 #ifdef __linux__
-int cold_accept4(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags)
-    cold_iocall(fd, 0, accept4, fd, addr, addrlen, (cone ? SOCK_NONBLOCK : 0) | flags)
+static int accept4_impl(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+    cold_iocall(fd, CONE_IO_ONE, accept4, fd, addr, addrlen, flags)
+
+int cold_accept4(int fd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+    flags |= cone ? SOCK_NONBLOCK : 0;
+    int client = accept4_impl(fd, addr, addrlen, flags);
+    #if CONE_EV_URING
+        // The number may have been cached for an fd closed without `cold_close`.
+        if (client >= 0)
+            cold_remember(client, flags & SOCK_NONBLOCK ? COLD_FD_NONBLOCKING : COLD_FD_BLOCKING);
+    #endif
+    return client;
+}
 
-int cold_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
-    cold_iocall(fd, 0, accept4, fd, addr, addrlen, (cone ? SOCK_NONBLOCK : 0))
+int cold_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+    return cold_accept4(fd, addr, addrlen, 0);
+}
 
 int cold_recvmmsg(int fd, struct mmsghdr *msgvec, unsigned vlen, int flags, struct timespec *timeout)
     cold_iocall(fd, 0, recvmmsg, fd, msgvec, vlen, flags, timeout)
 
 int cold_sendmmsg(int fd, struct mmsghdr *msgvec, unsigned vlen, int flags)
     cold_iocall(fd, 1, sendmmsg, fd, msgvec, vlen, flags)
+
+int cold_statx(int dirfd, const char *path, int flags, unsigned mask, struct statx *buf)
+    cold_iofile(1, (.opcode = IORING_OP_STATX, .fd = dirfd, .addr = (uintptr_t)path, .len = mask, .off = (uintptr_t)buf, .statx_flags = flags),
+        { return statx(dirfd, path, flags, mask, buf); })
 #else
 static int accept_impl(int fd, struct sockaddr *addr, socklen_t *addrlen)
-    cold_iocall(fd, 0, accept, fd, addr, addrlen)
+    cold_iocall(fd, CONE_IO_ONE, accept, fd, addr, addrlen)
 
 int cold_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
     int client = accept_impl(fd, addr, addrlen);
@@ -103,3 +205,72 @@ int cold_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
     return client;
 }
 #endif
+
+struct cold_acceptor {
+    int fd;
+    int (*accepted)(void *, int);
+    void *data;
+};
+
+static void cold_acceptor_move(void *to, void *from) {
+    memcpy(to, from, sizeof(struct cold_acceptor));
+}
+
+// Running out of fds or memory is not a problem with the socket, so it is waited out
+// instead of leaving this loop without a listener.
+#define cold_accept_exhausted(e) ((e) == EMFILE || (e) == ENFILE || (e) == ENOBUFS || (e) == ENOMEM)
+
+static int cold_acceptor_run(struct cold_acceptor *a) {
+    int fd;
+    while ((fd = cold_accept(a->fd, NULL, NULL)) >= 0 || errno == ECONNABORTED || errno == EINTR
+        || (cold_accept_exhausted(errno) && !cone_sleep(10000)))
+        if (fd >= 0 && a->accepted(a->data, fd) MUN_RETHROW)
+            return close(a->fd), -1;
+    int err = errno;
+    close(a->fd);
+    return err == ECANCELED ? 0 : (errno = err) MUN_RETHROW_OS;
+}
+
+#ifdef SO_REUSEPORT
+#ifndef SOCK_CLOEXEC
+#define SOCK_CLOEXEC 0 // XXX `fcntl` below is racy in forking multithreaded applications.
+#endif
+
+static int cold_reuseport(const struct sockaddr *addr, socklen_t addrlen, int backlog) {
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 MUN_RETHROW_OS)
+        return -1;
+    if ((!SOCK_CLOEXEC && fcntl(fd, F_SETFD, FD_CLOEXEC))
+     || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) || bind(fd, addr, addrlen)
+     || listen(fd, backlog) MUN_RETHROW_OS || cold_unblock(fd))
+        return close(fd), -1;
+    return fd;
+}
+#endif
+
+int cold_listen_group(struct cone_group *g, struct sockaddr *addr, socklen_t *addrlen, int backlog,
+                      int (*accepted)(void *, int), void *data, struct cone **acceptors) {
+#ifdef SO_REUSEPORT
+    unsigned n = cone_group_size(g), i = 0;
+    for (; i < n; i++) {
+        struct cold_acceptor a = {cold_reuseport(addr, *addrlen, backlog), accepted, data};
+        struct cone_closure body = {(int(*)(void*))&cold_acceptor_run, &a, sizeof(a), &cold_acceptor_move};
+        if (a.fd < 0)
+            break;
+        // If the port was 0, the rest have to use the one the kernel picked for the first.
+        if ((i == 0 && getsockname(a.fd, addr, addrlen) MUN_RETHROW_OS)
+         || (acceptors[i] = cone_spawn_pinned(g, i, CONE_DEFAULT_STACK, body)) == NULL) {
+            close(a.fd);
+            break;
+        }
+    }
+    if (i == n)
+        return 0;
+    while (i--) // these will close their own sockets
+        cone_cancel(acceptors[i]), cone_drop(acceptors[i]);
+    return -1;
+#else
+    return (void)g, (void)addr, (void)addrlen, (void)backlog, (void)accepted, (void)data, (void)acceptors,
+        mun_error(ENOSYS, "SO_REUSEPORT is not supported");
+#endif
+}
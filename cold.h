@@ -2,6 +2,7 @@
 
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
 
 #if __cplusplus
@@ -11,10 +12,19 @@ extern "C" {
 // Switch a file descriptor into non-blocking mode. See fcntl(2) for error codes.
 int cold_unblock(int fd);
 
+// `close`, but also undo `cone_fd_register` on the current event loop, if any.
+int cold_close(int fd);
+
 // See the manual for your libc of choice. When called from inside a coroutine,
 // * `listen` and `connect` switch their argument into non-blocking mode;
-// * `accept` does the same with the returned file descriptor;
-// * anything that would return EAGAIN is instead coroutine-blocking.
+// * `accept` does the same with the returned file descriptor, and its waits are exclusive
+//   (see `CONE_IO_ONE`), so only one of the coroutines accepting on a socket is woken;
+// * anything that would return EAGAIN is instead coroutine-blocking;
+// * with `CONE_EV_URING`, `pread`, `pwrite`, `fsync`, `openat`, `statx`, and also `read`,
+//   `readv`, `write`, `writev` on blocking fds (e.g. regular files) are submitted to the
+//   event loop's io_uring and are coroutine-blocking too. Otherwise, they block the thread.
+//   Whether an fd is blocking is only checked the first time, so if it is closed without
+//   `cold_close` or its mode is changed other than by `cold_unblock`, that may be stale.
 ssize_t cold_read     (int, void *, size_t);
 ssize_t cold_pread    (int, void *, size_t, off_t);
 ssize_t cold_readv    (int, const struct iovec *, int);
@@ -30,12 +40,31 @@ ssize_t cold_sendmsg  (int, const struct msghdr *, int);
 int     cold_listen   (int, int);
 int     cold_connect  (int, const struct sockaddr *, socklen_t);
 int     cold_accept   (int, struct sockaddr *, socklen_t *);
+int     cold_fsync    (int);
+int     cold_openat   (int, const char *, int, mode_t);
 #if defined(__linux__) && defined(_GNU_SOURCE)
 int     cold_accept4  (int, struct sockaddr *, socklen_t *, int);
 int     cold_recvmmsg (int, struct mmsghdr *, unsigned, int, struct timespec *);
 int     cold_sendmmsg (int, struct mmsghdr *, unsigned, int);
+int     cold_statx    (int, const char *, int, unsigned, struct statx *);
 #endif
 
+struct cone;
+struct cone_group;
+
+// Create a `SO_REUSEPORT` stream socket bound to the same address for each loop in a group
+// and spawn on that loop a coroutine that accepts connections on it, passing each to
+// `accepted(data, fd)`; this should hand the fd off quickly, e.g. to a new coroutine, which
+// will be on the same loop. As the kernel spreads connections among the sockets, each one
+// stays on a single loop. Like `accept`, the address is also an output: if the port is 0,
+// the one picked by the kernel (for all sockets) is written back. `acceptors` should have
+// room for `cone_group_size` coroutines; cancel them to stop, and they will close their
+// sockets. They are pinned to their loops, and if the process or system runs out of fds,
+// they keep retrying after a short sleep. Note that `accepted` is called from several
+// threads. Fails with ENOSYS where `SO_REUSEPORT` is not available.
+int cold_listen_group(struct cone_group *, struct sockaddr *, socklen_t *, int backlog,
+                      int (*accepted)(void *, int), void *data, struct cone **acceptors);
+
 #if __cplusplus
 }
 #endif
@@ -1,5 +1,12 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // MAP_ANONYMOUS, MAP_NORESERVE, madvise, sched_setaffinity
+#elif defined(__APPLE__) && !defined(_DARWIN_C_SOURCE)
+#define _DARWIN_C_SOURCE
+#endif
+
 #include "cone.h"
 #include <fcntl.h>
+#include <pthread.h>
 #include <sched.h>
 #include <signal.h>
 #include <unistd.h>
@@ -13,6 +20,7 @@
 #define CONE_ASAN 1
 void __sanitizer_start_switch_fiber(void** fake_stack_save, const void* bottom, size_t size);
 void __sanitizer_finish_switch_fiber(void* fake_stack_save, const void** old_bottom, size_t* old_size);
+void __asan_unpoison_memory_region(void const volatile *addr, size_t size);
 #endif
 
 // Mach-O requires some weird link-time magic to properly support weak symbols,
@@ -24,10 +32,10 @@ struct /* __cxxabiv1:: */ __cxa_eh_globals {
 } *__cxa_get_globals();
 #endif
 
-#if !CONE_EV_SELECT && !CONE_EV_EPOLL && !CONE_EV_KQUEUE
+#if !CONE_EV_SELECT && !CONE_EV_EPOLL && !CONE_EV_KQUEUE && !CONE_EV_URING
 #define CONE_EV_EPOLL  (__linux__)
 #define CONE_EV_KQUEUE (__APPLE__ || __FreeBSD__)
-#elif (!!CONE_EV_SELECT + !!CONE_EV_EPOLL + !!CONE_EV_KQUEUE) != 1
+#elif (!!CONE_EV_SELECT + !!CONE_EV_EPOLL + !!CONE_EV_KQUEUE + !!CONE_EV_URING) != 1
 #error "selected more than one of CONE_EV_*"
 #endif
 
@@ -47,16 +55,34 @@ struct /* __cxxabiv1:: */ __cxa_eh_globals {
 #include <sys/epoll.h>
 #elif CONE_EV_KQUEUE
 #include <sys/event.h>
+#elif CONE_EV_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #else
 #include <sys/select.h>
 #endif
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#if CONE_MMAP_STACKS
+#include <sys/mman.h>
+#ifndef CONE_STACK_MADVISE
+#define CONE_STACK_MADVISE MADV_DONTNEED
+#endif
+#endif
+
 #if CONE_ASM_X64
 #define CONE_STACK_ALIGN _Alignof(max_align_t)
 #elif CONE_ASM_ARM64
 #define CONE_STACK_ALIGN 16
 #endif
 
+#define CONE_CACHE_LINE 64
+
 enum {
     CONE_FLAG_LAST_REF  = 0x01,
     CONE_FLAG_SCHEDULED = 0x02,
@@ -67,6 +93,9 @@ enum {
     CONE_FLAG_TIMED_OUT = 0x40,
     CONE_FLAG_JOINED    = 0x80,
     CONE_FLAG_NO_INTR   = 0x100,
+    CONE_FLAG_TRACKED   = 0x200,
+    CONE_FLAG_PINNED    = 0x400,
+    CONE_FLAG_PARKED    = 0x800,
 };
 
 static void cone_run(struct cone *);
@@ -75,28 +104,99 @@ static void cone_run(struct cone *);
 // If it is known that the loop is not blocked in a syscall, this can be ignored.
 static struct cone_loop *cone_schedule(struct cone *, int);
 
-struct cone_event_schedule mun_vec(struct { mun_usec at; struct cone *c; });
+// Count the references from loop-local structures, i.e. the timer queue and the fd map.
+static void cone_pins(struct cone *, int delta);
+
+// A pending wakeup (`struct cone_timer`) is stored by whoever sets it, e.g. on the stack
+// of a sleeping coroutine, and knows its own `index` in the heap, so removing it does not
+// need a search. `next` links deadlines set by `cone_deadline` into `c->deadlines`.
+#define CONE_TIMER_NONE ((size_t)-1)
+
+// A 4-ary min-heap ordered by time, then by order of addition so that coroutines
+// waiting until the same moment (e.g. yielding) are woken in FIFO order. The time is
+// copied next to the pointer so that sifting only touches the timers it moves.
+struct cone_event_schedule {
+    struct mun_vec(struct cone_timer_slot { mun_usec at; struct cone_timer *t; }) heap;
+    unsigned long long seq;
+    // Timers may fire up to this late, so that ones close to each other fire together.
+    // The loop only wakes up at multiples of it.
+    mun_usec slack;
+    // `seq` when the loop last blocked, i.e. timers older than this were not due then.
+    // See `struct cone_loop_stats` for the counters.
+    unsigned long long blocked;
+    size_t expiries;
+    size_t wakeups;
+};
 
-static int cone_event_schedule_add(struct cone_event_schedule *ev, mun_usec at, struct cone *c, int deadline) {
-    return mun_vec_insert(ev, mun_vec_bisect(ev, at < _->at), &((mun_vec_type(ev)){at, mun_tag_add(c, !!deadline)}));
+static int cone_timer_before(const struct cone_timer_slot *a, const struct cone_timer_slot *b) {
+    return a->at < b->at || (a->at == b->at && a->t->seq < b->t->seq);
 }
 
-static void cone_event_schedule_del(struct cone_event_schedule *ev, mun_usec at, struct cone *c, int deadline) {
-    for (size_t i = mun_vec_bisect(ev, at < _->at); i-- && ev->data[i].at == at; )
-        if (ev->data[i].c == mun_tag_add(c, !!deadline))
-            return mun_vec_erase(ev, i, 1);
+static void cone_event_schedule_put(struct cone_event_schedule *ev, size_t i, struct cone_timer_slot e) {
+    ev->heap.data[i] = e;
+    e.t->index = i;
 }
 
-static mun_usec cone_event_schedule_emit(struct cone_event_schedule *ev, size_t limit) {
-    if (limit > ev->size)
-        limit = ev->size;
-    size_t i = 0;
-    // Could've spent a while pushing into the queue, so if the check fails once, re-read the timer.
-    for (mun_usec t = 0; i < limit && (ev->data[i].at <= t || (ev->data[i].at <= (t = mun_usec_monotonic()))); i++)
-        cone_schedule(mun_tag_ptr_aligned(ev->data[i].c, CONE_STACK_ALIGN),
-                      mun_tag_get_aligned(ev->data[i].c, CONE_STACK_ALIGN) ? CONE_FLAG_TIMED_OUT : CONE_FLAG_WOKEN);
-    mun_vec_erase(ev, 0, i);
-    return i ? 0 : ev->size ? ev->data->at : MUN_USEC_MAX;
+// Place `e` into the hole at `i`, moving it towards the root or the leaves as needed.
+static void cone_event_schedule_sift(struct cone_event_schedule *ev, size_t i, struct cone_timer_slot e) {
+    struct cone_timer_slot *h = ev->heap.data;
+    for (size_t p; i && cone_timer_before(&e, &h[p = (i - 1) / 4]); i = p)
+        cone_event_schedule_put(ev, i, h[p]);
+    for (size_t c; (c = i * 4 + 1) < ev->heap.size; ) {
+        size_t m = c;
+        for (size_t k = c + 1; k < c + 4 && k < ev->heap.size; k++)
+            if (cone_timer_before(&h[k], &h[m]))
+                m = k;
+        if (!cone_timer_before(&h[m], &e))
+            break;
+        cone_event_schedule_put(ev, i, h[m]);
+        i = m;
+    }
+    cone_event_schedule_put(ev, i, e);
+}
+
+static int cone_event_schedule_add(struct cone_event_schedule *ev, struct cone_timer *t) {
+    struct cone_timer_slot e = {t->at, t};
+    t->seq = ev->seq++;
+    if (mun_vec_append(&ev->heap, &e))
+        return -1;
+    cone_event_schedule_sift(ev, ev->heap.size - 1, e);
+    return cone_pins(t->c, 1), 0;
+}
+
+static void cone_event_schedule_del(struct cone_event_schedule *ev, struct cone_timer *t) {
+    if (t->index == CONE_TIMER_NONE)
+        return;
+    struct cone_timer_slot last = ev->heap.data[--ev->heap.size];
+    if (t->index != ev->heap.size)
+        cone_event_schedule_sift(ev, t->index, last);
+    t->index = CONE_TIMER_NONE;
+    cone_pins(t->c, -1);
+}
+
+// `now` is the loop's cached clock, which is updated if it turns out to be too old.
+static mun_usec cone_event_schedule_emit(struct cone_event_schedule *ev, size_t limit, mun_usec *now) {
+    size_t i = 0, expiries = 0;
+    int fresh = 0;
+    // Could've spent a while running coroutines, so if the check fails once, re-read the timer.
+    for (mun_usec prev = 0; i < limit && ev->heap.size && (ev->heap.data->at <= *now || (!fresh++ && ev->heap.data->at <= (*now = mun_usec_monotonic()))); i++) {
+        struct cone_timer *e = ev->heap.data->t;
+        // Nothing was due when the loop blocked, so without slack, each distinct expiry
+        // time would have needed a wakeup of its own.
+        if (e->seq < ev->blocked && e->at != prev)
+            expiries++, prev = e->at;
+        cone_event_schedule_del(ev, e);
+        cone_schedule(e->c, e->deadline ? CONE_FLAG_TIMED_OUT : CONE_FLAG_WOKEN);
+    }
+    ev->expiries += expiries;
+    ev->wakeups += !!expiries;
+    ev->blocked = 0;
+    if (i)
+        return 0;
+    if (!ev->heap.size)
+        return MUN_USEC_MAX;
+    mun_usec at = ev->heap.data->at;
+    return !ev->slack || at > MUN_USEC_MAX - ev->slack ? at : at + ev->slack - 1 - (at + ev->slack - 1) % ev->slack;
 }
 
 struct cone_event_fd {
@@ -106,39 +206,138 @@ struct cone_event_fd {
     struct cone_event_fd *link;
 };
 
-enum { IO_R = 1, IO_W = 2, IO_RW = 3 };
+enum { IO_R = 1, IO_W = 2, IO_RW = 3, IO_ET = 4, IO_ONE = 8 };
 
 struct cone_event_io {
     int poller;
-    int selfpipe[2];
+    int selfpipe[2]; // an eventfd on Linux, so both are the same
     // This flag is set while waiting for I/O to tell the other threads that a write
     // to the self-pipe is needed to make this loop react to additions to the run queue.
     CONE_ATOMIC(char) interruptible;
-    // epoll and select deduplicate events by file descriptor, so we need a hash map from file
-    // descriptors to linked lists of listeners.
+    // Number of fds with at least one waiter.
     size_t keys;
-    size_t capacity;
-    struct cone_event_fd **buckets;
+    // Indexed by fd, since they are small dense integers.
+    struct mun_vec(struct cone_event_fds {
+        // Pollers deduplicate events by file descriptor, so waiters are grouped by fd too.
+        struct cone_event_fd *waiters;
+        // Directions currently in the poller, i.e. the union of the waiters' flags, plus
+        // `IO_ONE` if all of them are exclusive and the poller can do that across loops.
+        unsigned char mode;
+        // `IO_ET` if the fd stays in the poller in edge-triggered mode (see `cone_fd_register`),
+        // plus `IO_R`/`IO_W` if there was an edge since the last wait.
+        unsigned char flags;
+    #if CONE_EV_URING
+        // Of the current polls: reading (or both, if `IO_ET`) and writing.
+        unsigned gen[2];
+    #endif
+    }) fds;
+#if CONE_EV_URING
+    // `poller` is the ring; SQEs are only queued here and submitted all at once when
+    // waiting for events, so an iteration of the loop costs a single `io_uring_enter`.
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    CONE_ATOMIC(unsigned) *sq_head, *sq_tail, *cq_head, *cq_tail;
+    unsigned sq_entries, sq_mask, cq_mask, tail, gen;
+    void *rings;
+    size_t rings_size;
+#endif
 };
 
-// Must be a power of 2.
-#define CONE_MIN_FDS_CAP 64
+#if CONE_EV_URING
+// Should fit all SQEs created during one iteration; if it does not, they are submitted early.
+#define CONE_URING_ENTRIES 256
+// `user_data` of the poll on the self-pipe. Other polls are tagged with the fd, the direction
+// (`IO_RW` for edge-triggered ones), and a generation. Other operations are pointers to
+// `struct cone_event_op`, which are aligned so the direction bits are 0. Removals and
+// cancellations are 0 and only fail harmlessly.
+#define CONE_URING_PING (1ull << 63)
+#define CONE_URING_TAG(fd, gen, dir) ((unsigned long long)(gen) << 34 | (unsigned long long)(unsigned)(fd) << 2 | (dir))
+#define CONE_URING_GEN_MASK ((1u << 29) - 1)
+
+static int cone_event_io_uring_enter(struct cone_event_io *set, unsigned wait, struct io_uring_getevents_arg *arg) {
+    atomic_store_explicit(set->sq_tail, set->tail, memory_order_release);
+    unsigned n = set->tail - atomic_load_explicit(set->sq_head, memory_order_acquire);
+    return syscall(__NR_io_uring_enter, set->poller, n, wait, arg ? IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG : 0, arg, sizeof(*arg));
+}
+
+static struct io_uring_sqe *cone_event_io_uring_sqe(struct cone_event_io *set) {
+    if (set->tail - atomic_load_explicit(set->sq_head, memory_order_acquire) == set->sq_entries)
+        if (cone_event_io_uring_enter(set, 0, NULL) < 0)
+            return NULL;
+    if (set->tail - atomic_load_explicit(set->sq_head, memory_order_acquire) == set->sq_entries)
+        return errno = EBUSY, NULL;
+    return &set->sqes[set->tail++ & set->sq_mask];
+}
+
+static int cone_event_io_uring_ping(struct cone_event_io *set) {
+    struct io_uring_sqe *sqe = cone_event_io_uring_sqe(set);
+    if (!sqe) return -1;
+    *sqe = (struct io_uring_sqe){.opcode = IORING_OP_POLL_ADD, .fd = set->selfpipe[0], .len = IORING_POLL_ADD_MULTI,
+                                 .poll32_events = POLLIN, .user_data = CONE_URING_PING};
+    return 0;
+}
+
+// An operation submitted through `cone_ioring`; its address is the `user_data`.
+struct cone_event_op {
+    struct cone *c;
+    int res;
+    int done;
+};
+
+static int cone_event_io_uring_submit(struct cone_event_io *set, const struct io_uring_sqe *src, struct cone_event_op *op) {
+    struct io_uring_sqe *sqe = cone_event_io_uring_sqe(set);
+    if (!sqe) return -1;
+    *sqe = *src, sqe->user_data = (uintptr_t)op;
+    return cone_pins(op->c, 1), 0;
+}
+
+// The fd must already be in `set->fds`.
+static int cone_event_io_uring_poll(struct cone_event_io *set, int fd, int dir, unsigned events) {
+    // Removals are only submitted at the next wait, by which time the fd may have been closed
+    // and reused, and the old poll may have completed again; generations filter out such events.
+    unsigned *gen = &set->fds.data[fd].gen[dir == IO_W];
+    struct io_uring_sqe *sqe = cone_event_io_uring_sqe(set);
+    if (!sqe) return -1;
+    if (events)
+        *gen = set->gen = (set->gen + 1) & CONE_URING_GEN_MASK;
+    unsigned long long tag = CONE_URING_TAG(fd, *gen, dir);
+    // Multishot polls are edge-triggered, but they also fire once on arming if the fd is
+    // already ready, so adding one per wait and removing it after an event is level-triggered.
+    *sqe = events ? (struct io_uring_sqe){.opcode = IORING_OP_POLL_ADD, .fd = fd, .len = IORING_POLL_ADD_MULTI,
+                                          .poll32_events = events, .user_data = tag}
+                  : (struct io_uring_sqe){.opcode = IORING_OP_POLL_REMOVE, .fd = -1, .addr = tag, .flags = IOSQE_CQE_SKIP_SUCCESS};
+    return 0;
+}
+#endif
 
 static void cone_event_io_fini(struct cone_event_io *set) {
     if (set->poller >= 0)
         close(set->poller);
+    #if CONE_EV_URING
+        if (set->sqes)
+            munmap(set->sqes, set->sq_entries * sizeof(struct io_uring_sqe));
+        if (set->rings)
+            munmap(set->rings, set->rings_size);
+    #endif
+    if (set->selfpipe[1] != set->selfpipe[0])
+        close(set->selfpipe[1]);
     if (set->selfpipe[0] >= 0)
-        close(set->selfpipe[0]), close(set->selfpipe[1]);
-    if (set->buckets)
-        free(set->buckets);
+        close(set->selfpipe[0]);
+    mun_vec_fini(&set->fds);
 }
 
 static int cone_event_io_init(struct cone_event_io *set) {
     set->selfpipe[0] = set->selfpipe[1] = set->poller = -1;
-    // XXX racy in forking multithreaded applications (see `man fcntl`); use pipe2 on linux?
-    if (pipe(set->selfpipe) || fcntl(set->selfpipe[0], F_SETFD, FD_CLOEXEC)
-                            || fcntl(set->selfpipe[1], F_SETFD, FD_CLOEXEC) MUN_RETHROW_OS)
-        return cone_event_io_fini(set), -1;
+    #ifdef __linux__
+        // Both ends at once; also, the counter coalesces pings that arrive before a read.
+        if ((set->selfpipe[0] = set->selfpipe[1] = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK)) < 0 MUN_RETHROW_OS)
+            return cone_event_io_fini(set), -1;
+    #else
+        // XXX racy in forking multithreaded applications (see `man fcntl`).
+        if (pipe(set->selfpipe) || fcntl(set->selfpipe[0], F_SETFD, FD_CLOEXEC)
+                                || fcntl(set->selfpipe[1], F_SETFD, FD_CLOEXEC) MUN_RETHROW_OS)
+            return cone_event_io_fini(set), -1;
+    #endif
     #if CONE_EV_KQUEUE
         struct kevent ev = {set->selfpipe[0], EVFILT_READ, EV_ADD, 0, 0, NULL};
         if ((set->poller = kqueue()) < 0
@@ -150,118 +349,209 @@ static int cone_event_io_init(struct cone_event_io *set) {
         if ((set->poller = epoll_create1(EPOLL_CLOEXEC)) < 0
          || epoll_ctl(set->poller, EPOLL_CTL_ADD, set->selfpipe[0], &ev) MUN_RETHROW_OS)
             return cone_event_io_fini(set), -1;
+    #elif CONE_EV_URING
+        struct io_uring_params p = {};
+        if ((set->poller = syscall(__NR_io_uring_setup, CONE_URING_ENTRIES, &p)) < 0 MUN_RETHROW_OS)
+            return cone_event_io_fini(set), -1;
+        // 5.11 for the timeout in `io_uring_enter`; multishot polls and CQE skipping need 5.17.
+        if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_CQE_SKIP) || !(p.features & IORING_FEAT_SINGLE_MMAP))
+            return cone_event_io_fini(set), mun_error(ENOSYS, "io_uring is too old");
+        set->rings_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        if (set->rings_size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+            set->rings_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        set->sq_entries = p.sq_entries;
+        void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, set->poller, IORING_OFF_SQES);
+        set->sqes = sqes == MAP_FAILED ? NULL : sqes;
+        void *rings = mmap(NULL, set->rings_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, set->poller, IORING_OFF_SQ_RING);
+        set->rings = rings == MAP_FAILED ? NULL : rings;
+        if ((!set->sqes || !set->rings) MUN_RETHROW_OS)
+            return cone_event_io_fini(set), -1;
+        set->sq_head = (void *)((char *)rings + p.sq_off.head);
+        set->sq_tail = (void *)((char *)rings + p.sq_off.tail);
+        set->cq_head = (void *)((char *)rings + p.cq_off.head);
+        set->cq_tail = (void *)((char *)rings + p.cq_off.tail);
+        set->sq_mask = *(unsigned *)((char *)rings + p.sq_off.ring_mask);
+        set->cq_mask = *(unsigned *)((char *)rings + p.cq_off.ring_mask);
+        set->cqes = (void *)((char *)rings + p.cq_off.cqes);
+        set->tail = *set->sq_tail;
+        for (unsigned i = 0; i < p.sq_entries; i++)
+            ((unsigned *)((char *)rings + p.sq_off.array))[i] = i;
+        cone_event_io_uring_ping(set);
     #endif
-    if ((set->buckets = calloc(CONE_MIN_FDS_CAP, sizeof(struct cone_event_fd *))) == NULL)
-        return cone_event_io_fini(set), mun_error(ENOMEM, "could not allocate an fd hash map");
-    set->capacity = CONE_MIN_FDS_CAP;
     return 0;
 }
 
-static unsigned inthash(unsigned key) {
-    key = (key ^ 61) ^ (key >> 16);
-    key = key + (key << 3);
-    key = key ^ (key >> 4);
-    key = key * 0x27d4eb2d;
-    key = key ^ (key >> 15);
-    return key;
-}
-
-static struct cone_event_fd **cone_hash_find(struct cone_event_io *set, int fd) {
-    struct cone_event_fd **r = &set->buckets[inthash(fd) & (set->capacity - 1)];
-    while (*r && (*r)->fd != fd)
-        r = &(*r)->link;
-    return r;
-}
-
-static void cone_hash_update_size(struct cone_event_io *set, int delta) {
-    size_t size = set->keys += delta;
-    size_t capacity = set->capacity;
-    while (size * 5 > capacity * 6) capacity *= 2;
-    while (size * 2 < capacity * 1 && capacity > CONE_MIN_FDS_CAP) capacity /= 2;
-    if (capacity == set->capacity) return;
-
-    struct cone_event_fd **m = calloc(capacity, sizeof(struct cone_event_fd *));
-    if (!m) return; // ignore memory error and accept decreased performance
-    for (size_t i = 0; i < set->capacity; i++) {
-        for (struct cone_event_fd *p = set->buckets[i]; p; ) {
-            struct cone_event_fd **bucket = &m[inthash(p->fd) & (capacity - 1)];
-            struct cone_event_fd *a = p, *b = p;
-            while (b->link && b->link->fd == b->fd) b = b->link;
-            p = b->link, b->link = *bucket, *bucket = a;
-        }
-    }
-    free(set->buckets);
-    set->buckets = m;
-    set->capacity = capacity;
+// Make sure `set->fds.data[fd]` exists.
+static int cone_event_io_reserve(struct cone_event_io *set, int fd) {
+    size_t size = set->fds.size;
+    if ((size_t)fd < size)
+        return 0;
+    if (mun_vec_reserve(&set->fds, (size_t)fd + 1) MUN_RETHROW)
+        return -1;
+    set->fds.size = (size_t)fd + 1;
+    memset(&set->fds.data[size], 0, (set->fds.size - size) * sizeof(struct cone_event_fds));
+    return 0;
 }
 
-static int cone_event_io_set_mode(struct cone_event_io *set, int fd, int from, int to) {
+// The fd must already be in `set->fds`. On failure, `mode` is whatever the poller has now.
+static int cone_event_io_set_mode(struct cone_event_io *set, int fd, int to) {
+    #if !CONE_EV_EPOLL
+        to &= IO_RW;
+    #endif
+    unsigned char *mode = &set->fds.data[fd].mode;
+    int from = *mode;
     if (from == to) return 0;
     #if CONE_EV_KQUEUE
         int rflag = (to & IO_R) > (from & IO_R) ? EV_ADD : (to & IO_R) < (from & IO_R) ? EV_DELETE : 0;
         int wflag = (to & IO_W) > (from & IO_W) ? EV_ADD : (to & IO_W) < (from & IO_W) ? EV_DELETE : 0;
         struct kevent evs[] = {{fd, EVFILT_READ, rflag, 0, 0, NULL}, {fd, EVFILT_WRITE, wflag, 0, 0, NULL}};
-        return kevent(set->poller, &evs[!rflag], !!rflag + !!wflag, NULL, 0, NULL);
+        if (kevent(set->poller, &evs[!rflag], !!rflag + !!wflag, NULL, 0, NULL))
+            return -1;
     #elif CONE_EV_EPOLL
+        // Exclusive entries cannot be modified, and do not support EPOLLRDHUP.
+        if (from && to && (from | to) & IO_ONE) {
+            if (epoll_ctl(set->poller, EPOLL_CTL_DEL, fd, NULL))
+                return -1;
+            *mode = from = 0;
+        }
         int op = !from ? EPOLL_CTL_ADD : !to ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
-        int flags = (to & IO_R ? EPOLLIN|EPOLLRDHUP : 0) | (to & IO_W ? EPOLLOUT : 0);
-        return epoll_ctl(set->poller, op, fd, &(struct epoll_event){flags, {.fd = fd}});
-    #else
-        return (void)set, (void)fd, 0;
+        int flags = (to & IO_R ? EPOLLIN : 0) | (to & IO_W ? EPOLLOUT : 0)
+                  | (to & IO_ONE ? EPOLLEXCLUSIVE : to & IO_R ? EPOLLRDHUP : 0);
+        if (epoll_ctl(set->poller, op, fd, &(struct epoll_event){flags, {.fd = fd}}))
+            return -1;
+    #elif CONE_EV_URING
+        if ((to & IO_R) != (from & IO_R)) {
+            if (cone_event_io_uring_poll(set, fd, IO_R, to & IO_R ? POLLIN|POLLRDHUP : 0))
+                return -1;
+            *mode = (from & ~IO_R) | (to & IO_R);
+        }
+        if ((to & IO_W) != (from & IO_W) && cone_event_io_uring_poll(set, fd, IO_W, to & IO_W ? POLLOUT : 0))
+            return -1;
     #endif
+    *mode = to;
+    return 0;
+}
+
+static int cone_event_io_is_et(struct cone_event_io *set, int fd) {
+    return (size_t)fd < set->fds.size && set->fds.data[fd].flags & IO_ET;
 }
 
-static int cone_event_io_schedule_all(struct cone_event_io *set, int fd, int flags) {
-    struct cone_event_fd **bucket = cone_hash_find(set, fd);
-    struct cone_event_fd **it = bucket;
-    if (!*bucket) return 0; // nothing was listening for this event
-    int from = 0, to = 0;
-    for (struct cone_event_fd *e = *bucket; e && e->fd == fd; e = e->link) {
-        from |= e->flags;
-        if (e->flags & flags) {
+static void cone_event_io_schedule_all(struct cone_event_io *set, int fd, int flags) {
+    if ((size_t)fd >= set->fds.size)
+        return;
+    struct cone_event_fds *st = &set->fds.data[fd];
+    if (st->flags & IO_ET)
+        st->flags |= flags;
+    if (!st->waiters) return; // nothing was listening for this event
+    // Exclusive waiters are woken one per direction, in the order they started waiting;
+    // if the chosen one leaves something unconsumed, the fd will simply be reported again.
+    int to = 0, one = IO_ONE, taken = 0;
+    for (struct cone_event_fd **it = &st->waiters, *e; (e = *it);) {
+        int match = e->flags & flags & (e->flags & IO_ONE ? ~taken : IO_RW);
+        if (match) {
             *it = e->link;
+            cone_pins(e->c, -1);
             cone_schedule(e->c, CONE_FLAG_WOKEN);
+            if (e->flags & IO_ONE)
+                taken |= match;
         } else {
             it = &e->link;
-            to |= e->flags;
+            to |= e->flags & IO_RW, one &= e->flags;
         }
     }
-    mun_cant_fail(cone_event_io_set_mode(set, fd, from, to) MUN_RETHROW_OS);
-    return it == bucket;
+    if (!st->waiters)
+        set->keys--;
+    if (!(st->flags & IO_ET)) {
+    #if CONE_EV_URING
+        // Multishot polls only report new wakeups, so to see what is left unconsumed
+        // the remaining waiters need a fresh one.
+        if (taken & to)
+            mun_cant_fail(cone_event_io_set_mode(set, fd, 0) MUN_RETHROW_OS);
+    #endif
+        mun_cant_fail(cone_event_io_set_mode(set, fd, to ? to | one : 0) MUN_RETHROW_OS);
+    }
 }
 
-static int cone_event_io_add(struct cone_event_io *set, struct cone_event_fd *st) {
-    struct cone_event_fd **bucket = cone_hash_find(set, st->fd);
-    int from = 0;
-    for (struct cone_event_fd *e = *bucket; e && e->fd == st->fd; e = e->link)
-        from |= e->flags;
-    if (cone_event_io_set_mode(set, st->fd, from, from|st->flags) MUN_RETHROW_OS)
+static int cone_event_io_add(struct cone_event_io *set, struct cone_event_fd *ev) {
+    if (cone_event_io_reserve(set, ev->fd))
         return -1;
-    st->link = *bucket, *bucket = st;
-    if (!st->link) cone_hash_update_size(set, 1);
-    return 0;
+    struct cone_event_fds *st = &set->fds.data[ev->fd];
+    int to = st->waiters ? (st->mode | ev->flags) & (ev->flags | IO_RW) : ev->flags;
+    if (!(st->flags & IO_ET) && cone_event_io_set_mode(set, ev->fd, to) MUN_RETHROW_OS)
+        return -1;
+    if (!st->waiters)
+        set->keys++;
+    struct cone_event_fd **it = &st->waiters;
+    if (ev->flags & IO_ONE) // these are woken in FIFO order
+        while (*it) it = &(*it)->link;
+    ev->link = *it, *it = ev;
+    return cone_pins(ev->c, 1), 0;
 }
 
-static int cone_event_io_del(struct cone_event_io *set, struct cone_event_fd *st) {
-    struct cone_event_fd **bucket = cone_hash_find(set, st->fd);
-    struct cone_event_fd **it = bucket;
-    for (; *it != st; it = &(*it)->link)
-        if (!*it || (*it)->fd != st->fd)
+// Returns 1 if the waiter was removed, 0 if it has already been woken.
+static int cone_event_io_del(struct cone_event_io *set, struct cone_event_fd *ev) {
+    if ((size_t)ev->fd >= set->fds.size)
+        return 0;
+    struct cone_event_fds *st = &set->fds.data[ev->fd];
+    struct cone_event_fd **it = &st->waiters;
+    for (; *it != ev; it = &(*it)->link)
+        if (!*it)
             return 0;
-    int to = 0;
-    for (struct cone_event_fd *e = *bucket; e && e->fd == st->fd; e = e->link)
-        if (e != st) to |= e->flags;
-    if (cone_event_io_set_mode(set, st->fd, to|st->flags, to) MUN_RETHROW_OS)
+    int to = 0, one = IO_ONE;
+    for (struct cone_event_fd *e = st->waiters; e; e = e->link)
+        if (e != ev) to |= e->flags & IO_RW, one &= e->flags;
+    if (!(st->flags & IO_ET) && cone_event_io_set_mode(set, ev->fd, to ? to | one : 0) MUN_RETHROW_OS)
+        return -1;
+    *it = ev->link;
+    if (!st->waiters)
+        set->keys--;
+    return cone_pins(ev->c, -1), 1;
+}
+
+static int cone_event_io_register(struct cone_event_io *set, int fd) {
+    if (cone_event_io_is_et(set, fd))
+        return 0;
+    if (cone_event_io_reserve(set, fd))
         return -1;
-    *it = st->link;
-    if (it == bucket && (!st->link || st->link->fd != st->fd))
-        cone_hash_update_size(set, -1);
+    if (set->fds.data[fd].waiters)
+        return mun_error(EBUSY, "fd %d is being waited on", fd);
+    #if CONE_EV_KQUEUE
+        struct kevent evs[] = {{fd, EVFILT_READ, EV_ADD|EV_CLEAR, 0, 0, NULL}, {fd, EVFILT_WRITE, EV_ADD|EV_CLEAR, 0, 0, NULL}};
+        if (kevent(set->poller, evs, 2, NULL, 0, NULL) MUN_RETHROW_OS)
+            return -1;
+    #elif CONE_EV_EPOLL
+        struct epoll_event ev = {EPOLLIN|EPOLLRDHUP|EPOLLOUT|EPOLLET, {.fd = fd}};
+        if (epoll_ctl(set->poller, EPOLL_CTL_ADD, fd, &ev) MUN_RETHROW_OS)
+            return -1;
+    #elif CONE_EV_URING
+        if (cone_event_io_uring_poll(set, fd, IO_RW, POLLIN|POLLRDHUP|POLLOUT) MUN_RETHROW_OS)
+            return -1;
+    #else
+        return 0; // select has no such thing, so keep doing what it always does
+    #endif
+    // Nothing is known about the fd yet, so the first wait should retry the syscall.
+    set->fds.data[fd].flags = IO_ET | IO_RW;
     return 0;
 }
 
+static int cone_event_io_unregister(struct cone_event_io *set, int fd) {
+    if (!cone_event_io_is_et(set, fd))
+        return 0;
+    if (set->fds.data[fd].waiters)
+        return mun_error(EBUSY, "fd %d is being waited on", fd);
+    set->fds.data[fd].flags = 0;
+    #if CONE_EV_URING
+        return cone_event_io_uring_poll(set, fd, IO_RW, 0) MUN_RETHROW_OS;
+    #else
+        // Pretend the fd was in the poller normally so that `set_mode` removes it.
+        set->fds.data[fd].mode = IO_RW;
+        return cone_event_io_set_mode(set, fd, 0) MUN_RETHROW_OS;
+    #endif
+}
+
 static void cone_event_io_ping(struct cone_event_io *set) {
     if (atomic_exchange(&set->interruptible, 0))
-        write(set->selfpipe[1], "", 1);
+        write(set->selfpipe[1], &(uint64_t){1}, sizeof(uint64_t)); // eventfds only accept 8 bytes
 }
 
 static void cone_event_io_allow_ping(struct cone_event_io *set) {
@@ -270,12 +560,49 @@ static void cone_event_io_allow_ping(struct cone_event_io *set) {
 
 static void cone_event_io_consume_ping(struct cone_event_io *set) {
     if (!atomic_exchange(&set->interruptible, 0))
-        read(set->selfpipe[0], (char[4]){}, 4);
+        read(set->selfpipe[0], &(uint64_t){0}, sizeof(uint64_t));
+}
+
+#if CONE_EV_URING
+static int cone_event_io_uring_flags(struct cone_event_io *set, const struct io_uring_cqe *cqe) {
+    unsigned long long tag = cqe->user_data;
+    int fd = (unsigned)(tag >> 2), dir = tag & IO_RW;
+    if (tag == CONE_URING_PING) {
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            mun_cant_fail(cone_event_io_uring_ping(set) MUN_RETHROW_OS);
+        return 0;
+    }
+    if (!dir) {
+        struct cone_event_op *op = (struct cone_event_op *)(uintptr_t)tag;
+        if (op) {
+            op->res = cqe->res, op->done = 1;
+            cone_pins(op->c, -1);
+            cone_schedule(op->c, CONE_FLAG_WOKEN);
+        }
+        return 0;
+    }
+    if (cqe->res == -ECANCELED || (size_t)fd >= set->fds.size || set->fds.data[fd].gen[dir == IO_W] != tag >> 34)
+        return 0;
+    // A multishot poll without `F_MORE` is done. Level-triggered ones are removed after
+    // any event anyway, but edge-triggered ones have to be rearmed.
+    if (!(cqe->flags & IORING_CQE_F_MORE) && dir == IO_RW && cone_event_io_is_et(set, fd))
+        mun_cant_fail(cone_event_io_uring_poll(set, fd, IO_RW, POLLIN|POLLRDHUP|POLLOUT) MUN_RETHROW_OS);
+    int flags = cqe->res < 0 ? IO_RW : (cqe->res & (POLLIN|POLLRDHUP|POLLERR|POLLHUP) ? IO_R : 0)
+                                     | (cqe->res & (POLLOUT|POLLERR|POLLHUP) ? IO_W : 0);
+    return flags & dir;
 }
+#endif
 
-static int cone_event_io_emit(struct cone_event_io *set, mun_usec deadline) {
-    if (deadline == 0 && !set->keys) return 0;
-    mun_usec now = mun_usec_monotonic();
+static int cone_event_io_emit(struct cone_event_io *set, mun_usec deadline, mun_usec now) {
+    #if CONE_EV_URING
+        // Even with nothing to wait for, queued removals may be keeping closed files open,
+        // and edge-triggered polls would overflow the completion queue if never reaped.
+        if (deadline == 0 && !set->keys && set->tail == atomic_load_explicit(set->sq_head, memory_order_relaxed)
+         && atomic_load_explicit(set->cq_tail, memory_order_relaxed) == atomic_load_explicit(set->cq_head, memory_order_relaxed))
+            return 0;
+    #else
+        if (deadline == 0 && !set->keys) return 0;
+    #endif
     mun_usec timeout = now > deadline ? 0 : deadline - now;
     if (timeout > 60000000ll)
         timeout = 60000000ll;
@@ -286,16 +613,24 @@ static int cone_event_io_emit(struct cone_event_io *set, mun_usec deadline) {
     #elif CONE_EV_EPOLL
         struct epoll_event evs[64];
         int n = epoll_pwait2(set->poller, evs, 64, &ns, NULL);
+    #elif CONE_EV_URING
+        struct __kernel_timespec kns = {ns.tv_sec, ns.tv_nsec};
+        struct io_uring_getevents_arg arg = {.ts = (uintptr_t)&kns};
+        int n = cone_event_io_uring_enter(set, deadline != 0, &arg);
+        if (n < 0 && (errno == ETIME || errno == EBUSY || errno == EINTR))
+            n = 0; // timed out, or the completion queue overflowed and will be drained below
+        unsigned head = atomic_load_explicit(set->cq_head, memory_order_relaxed);
+        if (n >= 0)
+            n = atomic_load_explicit(set->cq_tail, memory_order_acquire) - head;
     #else
         fd_set rset = {}, wset = {};
         FD_SET(set->selfpipe[0], &rset);
         int max_fd = set->selfpipe[0];
-        for (size_t i = 0; i < set->capacity; i++) {
-            for (struct cone_event_fd *e = set->buckets[i]; e; e = e->link) {
-                if (max_fd < e->fd) max_fd = e->fd;
-                if (e->flags & IO_R) FD_SET(e->fd, &rset);
-                if (e->flags & IO_W) FD_SET(e->fd, &wset);
-            }
+        for (int fd = 0; (size_t)fd < set->fds.size; fd++) {
+            int mode = set->fds.data[fd].mode;
+            if (mode && max_fd < fd) max_fd = fd;
+            if (mode & IO_R) FD_SET(fd, &rset);
+            if (mode & IO_W) FD_SET(fd, &wset);
         }
         int n = pselect(max_fd + 1, &rset, &wset, NULL, &ns, NULL);
     #endif
@@ -305,7 +640,6 @@ static int cone_event_io_emit(struct cone_event_io *set, mun_usec deadline) {
         // This *could* also be done after this function returns, but doing it immediately
         // after the syscall reduces redundant pings.
         cone_event_io_consume_ping(set);
-    int removed_from_map = 0;
     for (int i = 0; i < n; i++) {
         #if CONE_EV_KQUEUE
             int fd = evs[i].ident;
@@ -314,14 +648,20 @@ static int cone_event_io_emit(struct cone_event_io *set, mun_usec deadline) {
             int fd = evs[i].data.fd;
             int flags = (evs[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLERR|EPOLLHUP) ? IO_R : 0)
                       | (evs[i].events & (EPOLLOUT|EPOLLERR|EPOLLHUP) ? IO_W : 0);
+        #elif CONE_EV_URING
+            const struct io_uring_cqe *cqe = &set->cqes[(head + i) & set->cq_mask];
+            int fd = (unsigned)(cqe->user_data >> 2);
+            int flags = cone_event_io_uring_flags(set, cqe);
         #else
             int fd = i;
             int flags = (FD_ISSET(fd, &rset) ? IO_R : 0) | (FD_ISSET(fd, &wset) ? IO_W : 0);
             n += 1 - !!flags - (flags == IO_RW); // `n` counts events; this maps it to file descriptors
         #endif
-        if (flags) removed_from_map += cone_event_io_schedule_all(set, fd, flags);
+        if (flags) cone_event_io_schedule_all(set, fd, flags);
     }
-    cone_hash_update_size(set, -removed_from_map);
+    #if CONE_EV_URING
+        atomic_store_explicit(set->cq_head, head + n, memory_order_release);
+    #endif
     return 0;
 }
 
@@ -329,39 +669,59 @@ struct cone_runq_it {
     CONE_ATOMIC(struct cone_runq_it *) next;
 };
 
+// Two FIFOs: a plain list for coroutines scheduled by the thread that runs the loop, which
+// is by far the most common case, and a Vyukov-style MPSC queue for the rest, which is
+// moved into the list in batches.
 struct cone_runq {
     CONE_ATOMIC(struct cone_runq_it *) head;
     CONE_ATOMIC(mun_usec) delay;
     struct cone_runq_it *tail;
     struct cone_runq_it stub;
+    struct cone_runq_it local; // `local.next` is the first item of the list
+    CONE_ATOMIC(struct cone_runq_it *) *last;
     mun_usec prev;
 };
 
-static void cone_runq_add(struct cone_runq *rq, struct cone_runq_it *it) {
-    atomic_store_explicit(&it->next, NULL, memory_order_relaxed);
+// The loop run by the current thread, i.e. the only one that may call `cone_runq_add_local`.
+static _Thread_local struct cone_loop *cone_runq_owner;
+
+static void cone_runq_init(struct cone_runq *rq) {
+    atomic_store_explicit(&rq->head, rq->tail = &rq->stub, memory_order_release);
+    rq->last = &rq->local.next;
+}
+
+// Push a chain of items already linked through `next`, from `first` to `last`.
+static void cone_runq_add_chain(struct cone_runq *rq, struct cone_runq_it *first, struct cone_runq_it *last) {
+    atomic_store_explicit(&last->next, NULL, memory_order_relaxed);
     // *Almost* wait-free - blocking between xchg and store blocks the consumer too.
     // TODO: ARM64 says release/acquire for head and next do not work?...
-    atomic_store(&atomic_exchange(&rq->head, it)->next, it);
+    atomic_store(&atomic_exchange(&rq->head, last)->next, first);
+}
+
+static void cone_runq_add(struct cone_runq *rq, struct cone_runq_it *it) {
+    cone_runq_add_chain(rq, it, it);
+}
+
+static void cone_runq_add_local_chain(struct cone_runq *rq, struct cone_runq_it *first, struct cone_runq_it *last) {
+    atomic_store_explicit(&last->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(rq->last, first, memory_order_relaxed);
+    rq->last = &last->next;
+}
+
+static void cone_runq_add_local(struct cone_runq *rq, struct cone_runq_it *it) {
+    cone_runq_add_local_chain(rq, it, it);
 }
 
 static int cone_runq_is_empty(struct cone_runq *rq) {
-    return rq->tail == &rq->stub && atomic_load(&rq->head) == &rq->stub;
+    return !atomic_load_explicit(&rq->local.next, memory_order_relaxed) && rq->tail == &rq->stub && atomic_load(&rq->head) == &rq->stub;
 }
 
-static struct cone *cone_runq_next(struct cone_runq *rq) {
+static struct cone_runq_it *cone_runq_pop_remote(struct cone_runq *rq) {
     struct cone_runq_it *tail = rq->tail;
     struct cone_runq_it *next = atomic_load(&tail->next);
     if (tail == &rq->stub) {
-        mun_usec now = mun_usec_monotonic();
-        mun_usec old = atomic_load_explicit(&rq->delay, memory_order_relaxed);
-        if (next == NULL) {
-            rq->prev = 0;
-            atomic_store_explicit(&rq->delay, old * 3 / 4, memory_order_relaxed);
+        if (next == NULL)
             return NULL; // empty or blocked while pushing first element
-        }
-        if (rq->prev)
-            atomic_store_explicit(&rq->delay, old * 3 / 4 + (now - rq->prev) / 4, memory_order_relaxed);
-        rq->prev = now;
         cone_runq_add(rq, &rq->stub);
         tail = rq->tail = next;
         next = atomic_load(&tail->next);
@@ -369,58 +729,193 @@ static struct cone *cone_runq_next(struct cone_runq *rq) {
     if (!next)
         return NULL; // blocked while pushing next element
     rq->tail = next;
-    return (struct cone *)tail;
+    return tail;
+}
+
+// Move everything pushed by other threads so far to the end of the local list. The time
+// between such batches while there is anything to run is the scheduling delay.
+static void cone_runq_drain(struct cone_runq *rq, mun_usec now) {
+    for (struct cone_runq_it *it; (it = cone_runq_pop_remote(rq));)
+        cone_runq_add_local(rq, it);
+    mun_usec old = atomic_load_explicit(&rq->delay, memory_order_relaxed);
+    if (!atomic_load_explicit(&rq->local.next, memory_order_relaxed))
+        rq->prev = 0, atomic_store_explicit(&rq->delay, old * 3 / 4, memory_order_relaxed);
+    else if (rq->prev)
+        atomic_store_explicit(&rq->delay, old * 3 / 4 + (now - rq->prev) / 4, memory_order_relaxed), rq->prev = now;
+    else
+        rq->prev = now;
+}
+
+static struct cone *cone_runq_next(struct cone_runq *rq) {
+    struct cone_runq_it *it = atomic_load_explicit(&rq->local.next, memory_order_relaxed);
+    if (!it)
+        return NULL;
+    struct cone_runq_it *next = atomic_load_explicit(&it->next, memory_order_relaxed);
+    atomic_store_explicit(&rq->local.next, next, memory_order_relaxed);
+    if (!next)
+        rq->last = &rq->local.next;
+    return (struct cone *)it;
 }
 
+// Memory of finished coroutines, binned by stack size and linked through `runq`. Only
+// touched by the thread that runs the loop, so a coroutine dropped by some other thread
+// goes into the cache of whichever loop that thread is running, if any.
+struct cone_stacks {
+    size_t size;
+    size_t limit;
+    struct { size_t size; struct cone_runq_it *head; } bins[4];
+};
+
 struct cone_loop {
     CONE_ATOMIC(unsigned) active;
     struct cone_runq now;
     struct cone_event_io io;
     struct cone_event_schedule at;
+    struct cone_stacks stacks;
+    struct cone_group *group;
+    // A coroutine that gave way with `cone_yield_to` and is runnable, but not queued yet
+    // in case whatever it switched to switches right back (see `cone_run`).
+    struct cone *handoff;
+    // Set while this loop has nothing to run and wants a sibling to give it something.
+    CONE_ATOMIC(char) hungry;
+    size_t wakeups;
+    // `mun_usec_monotonic` as of the start of this iteration, or the last timer check.
+    mun_usec clock;
+    // Polling without sleeping before a wait (see `cone_busy_poll`). `budget` is halved
+    // after spinning in vain and doubled after finding something, within `[limit / 16, limit]`.
+    struct { mun_usec limit, budget, time; size_t hits, misses; } spin;
+};
+
+struct cone_group {
+    // Coroutines on all loops, plus 1 until `cone_group_join`. Loops exit when this is 0.
+    CONE_ATOMIC(unsigned) active;
+    CONE_ATOMIC(unsigned) hungry;
+    CONE_ATOMIC(unsigned) running;
+    CONE_ATOMIC(unsigned) refs;
+    CONE_ATOMIC(unsigned) next; // where `cone_spawn_balanced` starts looking
+    struct cone_event done;
+    // Same as `done`, for `cone_group_join` called from a thread that runs no loop.
+    pthread_mutex_t lk;
+    pthread_cond_t cv;
+    int flags;
+    unsigned size;
+    struct cone_loop loops[];
 };
 
+static void cone_stacks_trim(struct cone_stacks *);
+static void cone_group_feed(struct cone_loop *);
+static inline void arch_pause(void);
+
 static int cone_loop_init(struct cone_loop *loop) {
-    atomic_store_explicit(&loop->now.head, loop->now.tail = &loop->now.stub, memory_order_release);
+    cone_runq_init(&loop->now);
+    loop->stacks.limit = CONE_STACK_CACHE;
+    loop->at.slack = CONE_TIMER_SLACK;
+    loop->spin.limit = loop->spin.budget = CONE_BUSY_POLL;
     return cone_event_io_init(&loop->io) MUN_RETHROW;
 }
 
+// Check the run queue and (without blocking) the fds until something becomes runnable,
+// the next timer is due, or the budget runs out. Returns whether anything was found.
+static int cone_loop_spin(struct cone_loop *loop, mun_usec next) {
+    mun_usec start = loop->clock, end = next - start > loop->spin.budget ? start + loop->spin.budget : next;
+    int hit = 0;
+    while (!(hit = !cone_runq_is_empty(&loop->now)) && loop->clock < end) {
+        mun_cant_fail(cone_event_io_emit(&loop->io, 0, loop->clock) MUN_RETHROW);
+        arch_pause();
+        loop->clock = mun_usec_monotonic();
+    }
+    mun_usec floor = loop->spin.limit / 16 ? loop->spin.limit / 16 : 1;
+    loop->spin.time += loop->clock - start;
+    if (hit)
+        loop->spin.hits++, loop->spin.budget = loop->spin.budget > loop->spin.limit / 2 ? loop->spin.limit : loop->spin.budget * 2;
+    else
+        loop->spin.misses++, loop->spin.budget = loop->spin.budget / 2 < floor ? floor : loop->spin.budget / 2;
+    return hit;
+}
+
 static void cone_loop_run(struct cone_loop *loop) {
+    int steal = loop->group && loop->group->flags & CONE_GROUP_STEAL;
+    struct cone_loop *outer = cone_runq_owner;
+    cone_runq_owner = loop;
     for (struct cone *c;;) {
+        loop->clock = mun_usec_monotonic();
+        cone_runq_drain(&loop->now, loop->clock);
+        if (steal)
+            cone_group_feed(loop);
         for (size_t limit = 256; limit-- && (c = cone_runq_next(&loop->now));)
             cone_run(c);
-        mun_usec next = cone_event_schedule_emit(&loop->at, 256);
-        if (next == MUN_USEC_MAX && !atomic_load_explicit(&loop->active, memory_order_acquire))
+        mun_usec next = cone_event_schedule_emit(&loop->at, 256, &loop->clock);
+        if (next == MUN_USEC_MAX && !atomic_load_explicit(loop->group ? &loop->group->active : &loop->active, memory_order_acquire))
             break;
         if (next > 0) {
+            if (steal && !atomic_load_explicit(&loop->hungry, memory_order_relaxed))
+                // Some sibling with too much to do will push into the run queue and ping.
+                atomic_store(&loop->hungry, 1), atomic_fetch_add(&loop->group->hungry, 1);
+            // Until pings are allowed, other threads can push into the run queue for free.
+            // Spinning has just polled the fds, so if it found something, do not poll again:
+            // exclusive waiters woken by it have not run yet, so the same event would wake more.
+            if (loop->spin.limit && cone_loop_spin(loop, next))
+                continue;
             cone_event_io_allow_ping(&loop->io);
             if (!cone_runq_is_empty(&loop->now)) // must be checked *after* enabling pings
                 cone_event_io_consume_ping(&loop->io), next = 0;
+            else
+                loop->wakeups++, loop->at.blocked = loop->at.seq;
             // else the paired `cone_event_io_consume_ping` is in `cone_event_io_emit`.
         }
         // If this fails, coroutines will get leaked.
-        mun_cant_fail(cone_event_io_emit(&loop->io, next) MUN_RETHROW);
+        mun_cant_fail(cone_event_io_emit(&loop->io, next, loop->clock) MUN_RETHROW);
     }
+    cone_runq_owner = outer;
     cone_event_io_fini(&loop->io);
-    mun_vec_fini(&loop->at);
+    mun_vec_fini(&loop->at.heap);
+    loop->stacks.limit = 0;
+    cone_stacks_trim(&loop->stacks);
 }
 
 struct cone {
-    struct cone_runq_it runq;
+    // Used by the scheduler and `cone_switch` all the time, so these have one cache line:
+    _Alignas(CONE_CACHE_LINE) struct cone_runq_it runq;
     CONE_ATOMIC(unsigned) flags;
+    // Loop-local things referencing this coroutine (see `cone_pins`); it cannot move to
+    // another loop while there are any. Only changed by the thread that runs the loop.
+    unsigned pins;
     void **rsp;
     struct cone_loop *loop;
-    struct cone_closure body;
-    struct cone_event done;
     #if CONE_ASAN
         const void * target_stack;
         size_t target_stack_size;
     #endif
-    struct mun_error error;
-    _Alignas(CONE_STACK_ALIGN) char stack[];
+    // Only used to start, finish, join, or destroy the coroutine:
+    struct { int (*code)(void *); void *data; } body;
+    struct cone_event done;
+    // Same as `done`, but for joiners on the same loop when coroutines cannot move.
+    struct cone_local_event joined;
+    struct cone_timer *deadlines;
+    size_t size;
+    // The block this coroutine's memory was carved out of by `cone_spawn_n`, if any.
+    struct cone_slab *slab;
+    // The stack is `size` bytes immediately below this structure, so overflowing it
+    // does not corrupt anything needed to switch back to the loop. Below the stack
+    // there is `struct mun_error` (see `cone_error`).
 };
 
+_Static_assert(offsetof(struct cone, body) <= CONE_CACHE_LINE, "scheduling state does not fit in a cache line");
+
+// The error record is only written to when the coroutine fails, so it is placed at
+// the far end of the stack instead of in the header. Like the unused parts of the stack,
+// it therefore takes no physical memory until touched.
+#define CONE_ERROR_SIZE ((sizeof(struct mun_error) + CONE_CACHE_LINE - 1) & ~(size_t)(CONE_CACHE_LINE - 1))
+#define CONE_BLOCK_SIZE(size) (CONE_ERROR_SIZE + (size) + sizeof(struct cone))
+#define cone_error(c) ((struct mun_error *)((char *)(c) - (c)->size - CONE_ERROR_SIZE))
+
 _Thread_local struct cone * cone = NULL;
 
+#if CONE_ASAN
+// The stack that a coroutine resumed by `cone_transfer` switches out to.
+static _Thread_local struct { struct cone *from; const void *stack; size_t size; } cone_asan_handoff;
+#endif
+
 static void cone_switch(struct cone *c) {
     #if CONE_CXX
         struct __cxa_eh_globals cxa_globals = *__cxa_get_globals();
@@ -475,12 +970,52 @@ static void cone_switch(struct cone *c) {
     #endif
     #if CONE_ASAN
         __sanitizer_finish_switch_fiber(fake_stack, &c->target_stack, &c->target_stack_size);
+        if (cone_asan_handoff.from) {
+            // Came from `cone_transfer`, whose caller is now suspended, but will go back to the loop.
+            struct cone *from = cone_asan_handoff.from;
+            from->target_stack = c->target_stack;
+            from->target_stack_size = c->target_stack_size;
+            c->target_stack = cone_asan_handoff.stack;
+            c->target_stack_size = cone_asan_handoff.size;
+            cone_asan_handoff.from = NULL;
+        }
     #endif
     #if CONE_CXX
         *__cxa_get_globals() = cxa_globals;
     #endif
 }
 
+// Resume `to`, which must be on the same loop and claimed by the caller, right away
+// instead of through the run queue. `from->rsp` is the loop's context and `to->rsp`
+// is `to`'s own, so after swapping them, `cone_switch(from)` continues in `to`, and
+// `to` returns to the loop when it next switches out (`cone_run` then sees that `cone`
+// is not the coroutine it started). `from` is resumed like after `cone_switch`.
+static void cone_transfer(struct cone *from, struct cone *to) {
+    void **rsp = from->rsp;
+    from->rsp = to->rsp;
+    to->rsp = rsp;
+    #if CONE_ASAN
+        cone_asan_handoff.from = from;
+        cone_asan_handoff.stack = from->target_stack;
+        cone_asan_handoff.size = from->target_stack_size;
+        from->target_stack = to->target_stack;
+        from->target_stack_size = to->target_stack_size;
+    #endif
+    mun_set_error_storage(cone_error(to));
+    cone = to;
+    cone_switch(from);
+}
+
+static void cone_pins(struct cone *c, int delta) {
+    c->pins += delta;
+}
+
+static void cone_group_release(struct cone_group *g) {
+    if (atomic_fetch_sub_explicit(&g->active, 1, memory_order_release) == 1)
+        for (unsigned i = 0; i < g->size; i++)
+            cone_event_io_ping(&g->loops[i].io); // time to exit
+}
+
 static void __attribute__((noreturn)) cone_body(struct cone *c) {
     #if CONE_ASAN
         __sanitizer_finish_switch_fiber(NULL, &c->target_stack, &c->target_stack_size);
@@ -490,7 +1025,10 @@ static void __attribute__((noreturn)) cone_body(struct cone *c) {
     #endif
     c->flags |= (c->body.code(c->body.data) ? CONE_FLAG_FAILED : 0) | CONE_FLAG_FINISHED;
     atomic_fetch_sub_explicit(&c->loop->active, 1, memory_order_release);
+    if (c->loop->group)
+        cone_group_release(c->loop->group);
     cone_wake(&c->done, (size_t)-1, 0);
+    cone_local_wake(&c->joined, (size_t)-1, 0);
     #if CONE_ASAN
         __sanitizer_start_switch_fiber(NULL, c->target_stack, c->target_stack_size);
     #endif
@@ -508,46 +1046,357 @@ static void __attribute__((noreturn)) cone_body(struct cone *c) {
     __builtin_unreachable();
 }
 
+// The actual stack size for a requested one. Everything in the block is aligned to a cache
+// line so that `struct cone` is too.
+static size_t cone_stack_size(size_t size) {
+    size = (size + CONE_CACHE_LINE - 1) & ~(size_t)(CONE_CACHE_LINE - 1);
+    #if CONE_MMAP_STACKS
+        // Whole pages are reserved anyway, so the slack might as well be usable.
+        size_t page = sysconf(_SC_PAGESIZE);
+        size = (CONE_BLOCK_SIZE(size) + page - 1) / page * page - CONE_BLOCK_SIZE(0);
+    #endif
+    return size;
+}
+
+static struct cone *cone_stack_new(size_t size) {
+    #if CONE_MMAP_STACKS
+        // [guard page | error | stack | struct cone], committed by the kernel as pages are touched.
+        size_t page = sysconf(_SC_PAGESIZE);
+        char *p = mmap(NULL, page + CONE_BLOCK_SIZE(size), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+        if (mprotect(p, page, PROT_NONE))
+            return munmap(p, page + CONE_BLOCK_SIZE(size)), NULL;
+        struct cone *c = (struct cone *)(p + page + CONE_ERROR_SIZE + size);
+    #else
+        void *p = NULL;
+        if (posix_memalign(&p, CONE_CACHE_LINE, CONE_BLOCK_SIZE(size)))
+            return NULL;
+        struct cone *c = (struct cone *)((char *)p + CONE_ERROR_SIZE + size);
+    #endif
+    c->slab = NULL;
+    return c;
+}
+
+// Memory for many coroutines allocated at once. Parts of a mapping can be unmapped
+// separately, so with `CONE_MMAP_STACKS` the blocks are independent as soon as the guard
+// pages are set up; otherwise, the slab is freed when the last of its blocks is. Such
+// blocks are never cached, since one of them would keep the whole slab allocated.
+struct cone_slab {
+    CONE_ATOMIC(size_t) refs;
+};
+
+static int cone_stack_new_n(size_t size, size_t n, struct cone **out) {
+    #if CONE_MMAP_STACKS
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t step = page + CONE_BLOCK_SIZE(size);
+        char *p = mmap(NULL, step * n, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+            return -1;
+        for (size_t i = 0; i < n; i++) {
+            if (mprotect(p + step * i, page, PROT_NONE))
+                return munmap(p, step * n), -1;
+            out[i] = (struct cone *)(p + step * i + page + CONE_ERROR_SIZE + size);
+            out[i]->slab = NULL;
+        }
+    #else
+        void *p = NULL;
+        if (posix_memalign(&p, CONE_CACHE_LINE, CONE_CACHE_LINE + CONE_BLOCK_SIZE(size) * n))
+            return -1;
+        struct cone_slab *slab = p;
+        atomic_init(&slab->refs, n);
+        for (size_t i = 0; i < n; i++) {
+            out[i] = (struct cone *)((char *)p + CONE_CACHE_LINE + CONE_BLOCK_SIZE(size) * i + CONE_ERROR_SIZE + size);
+            out[i]->slab = slab;
+        }
+    #endif
+    return 0;
+}
+
+static void cone_stack_free(struct cone *c) {
+    #if CONE_MMAP_STACKS
+        size_t page = sysconf(_SC_PAGESIZE);
+        munmap((char *)cone_error(c) - page, page + CONE_BLOCK_SIZE(c->size));
+    #else
+        if (!c->slab)
+            free(cone_error(c));
+        else if (atomic_fetch_sub_explicit(&c->slab->refs, 1, memory_order_acq_rel) == 1)
+            free(c->slab);
+    #endif
+}
+
+// Give the memory used by a finished coroutine back to the kernel, except for the page
+// that `struct cone` is on, since that one will be touched again immediately on reuse.
+static void cone_stack_release(struct cone *c) {
+    #if CONE_MMAP_STACKS
+        size_t page = sysconf(_SC_PAGESIZE);
+        char *top = (char *)((uintptr_t)c & ~(uintptr_t)(page - 1));
+        if (top > (char *)cone_error(c))
+            madvise(cone_error(c), top - (char *)cone_error(c), CONE_STACK_MADVISE);
+    #else
+        (void)c;
+    #endif
+}
+
+#define CONE_STACKS_BINS (sizeof(((struct cone_stacks *)0)->bins) / sizeof(((struct cone_stacks *)0)->bins[0]))
+
+static struct cone *cone_stacks_get(struct cone_stacks *s, size_t size) {
+    for (size_t i = 0; s && i < CONE_STACKS_BINS; i++) {
+        struct cone_runq_it *it = s->bins[i].head;
+        if (it && s->bins[i].size == size) {
+            s->bins[i].head = atomic_load_explicit(&it->next, memory_order_relaxed);
+            s->size -= CONE_BLOCK_SIZE(size);
+            return (struct cone *)it;
+        }
+    }
+    return cone_stack_new(size);
+}
+
+static void cone_stacks_put(struct cone_stacks *s, struct cone *c) {
+    size_t i = 0;
+    if (!s || c->slab || s->size + CONE_BLOCK_SIZE(c->size) > s->limit)
+        return cone_stack_free(c);
+    while (i < CONE_STACKS_BINS && !(s->bins[i].head && s->bins[i].size == c->size)) i++;
+    if (i == CONE_STACKS_BINS)
+        for (i = 0; i < CONE_STACKS_BINS && s->bins[i].head; i++) {}
+    if (i == CONE_STACKS_BINS)
+        return cone_stack_free(c); // too many different sizes
+    cone_stack_release(c);
+    atomic_store_explicit(&c->runq.next, s->bins[i].head, memory_order_relaxed);
+    s->bins[i].size = c->size;
+    s->bins[i].head = &c->runq;
+    s->size += CONE_BLOCK_SIZE(c->size);
+}
+
+// Take `n` blocks from the cache, allocating whatever it does not have in one go.
+static int cone_stacks_get_n(struct cone_stacks *s, size_t size, size_t n, struct cone **out) {
+    size_t k = 0;
+    for (size_t i = 0; i < CONE_STACKS_BINS; i++) {
+        for (struct cone_runq_it *it; k < n && s->bins[i].size == size && (it = s->bins[i].head); k++) {
+            s->bins[i].head = atomic_load_explicit(&it->next, memory_order_relaxed);
+            s->size -= CONE_BLOCK_SIZE(size);
+            out[k] = (struct cone *)it;
+        }
+    }
+    if (k == n || !cone_stack_new_n(size, n - k, out + k))
+        return 0;
+    while (k--)
+        cone_stacks_put(s, out[k]);
+    return -1;
+}
+
+static void cone_stacks_trim(struct cone_stacks *s) {
+    for (size_t i = 0; i < CONE_STACKS_BINS; i++) {
+        while (s->size > s->limit && s->bins[i].head) {
+            struct cone_runq_it *it = s->bins[i].head;
+            s->bins[i].head = atomic_load_explicit(&it->next, memory_order_relaxed);
+            s->size -= CONE_BLOCK_SIZE(s->bins[i].size);
+            cone_stack_free((struct cone *)it);
+        }
+    }
+}
+
+#if CONE_ASAN
+#define CONE_NO_ASAN __attribute__((no_sanitize_address))
+#else
+#define CONE_NO_ASAN
+#endif
+
+// Stacks of tracked coroutines are filled with this, so the deepest point they reach is
+// the lowest word that is not it. Slightly underestimates if a function happens to write
+// exactly this value right where the stack ends, but who cares.
+#define CONE_STACK_POISON 0xCC
+
+static CONE_ATOMIC(int) cone_stack_tracking;
+
+static struct {
+    CONE_ATOMIC(uintptr_t) code;
+    CONE_ATOMIC(size_t) count, stack, max, hist[16];
+} cone_stack_stats[256];
+
+#define CONE_STACK_STATS (sizeof(cone_stack_stats) / sizeof(cone_stack_stats[0]))
+
+size_t CONE_NO_ASAN cone_stack_depth(struct cone *c) {
+    if (!(atomic_load_explicit(&c->flags, memory_order_relaxed) & CONE_FLAG_TRACKED))
+        return 0;
+    const uintptr_t *p = (const uintptr_t *)((char *)c - c->size);
+    uintptr_t poison;
+    memset(&poison, CONE_STACK_POISON, sizeof(poison));
+    while ((char *)p < (char *)c && *p == poison)
+        p++;
+    return (char *)c - (char *)p;
+}
+
+static void cone_stack_record(struct cone *c) {
+    size_t depth = cone_stack_depth(c);
+    uintptr_t code = (uintptr_t)c->body.code;
+    // Open addressing with no deletions, so the first empty slot ends the search.
+    for (size_t i = 0, h = (code >> 4) % CONE_STACK_STATS; i < CONE_STACK_STATS; i++, h = (h + 1) % CONE_STACK_STATS) {
+        uintptr_t key = 0;
+        if (!atomic_compare_exchange_strong(&cone_stack_stats[h].code, &key, code) && key != code)
+            continue;
+        size_t bin = 0;
+        while (bin < 15 && depth >= (size_t)1024 << bin)
+            bin++;
+        atomic_fetch_add_explicit(&cone_stack_stats[h].hist[bin], 1, memory_order_relaxed);
+        for (size_t m = atomic_load(&cone_stack_stats[h].max); m < depth && !atomic_compare_exchange_weak(&cone_stack_stats[h].max, &m, depth);) {}
+        for (size_t m = atomic_load(&cone_stack_stats[h].stack); m < c->size && !atomic_compare_exchange_weak(&cone_stack_stats[h].stack, &m, c->size);) {}
+        atomic_fetch_add_explicit(&cone_stack_stats[h].count, 1, memory_order_release);
+        return;
+    }
+}
+
+int cone_stack_track(int enable) {
+    return atomic_exchange(&cone_stack_tracking, !!enable);
+}
+
+size_t cone_stack_usage(struct cone_stack_usage *out, size_t n) {
+    size_t r = 0;
+    for (size_t i = 0; i < CONE_STACK_STATS; i++) {
+        if (!atomic_load_explicit(&cone_stack_stats[i].count, memory_order_acquire))
+            continue;
+        if (r < n) {
+            out[r].code = (int (*)(void *))atomic_load(&cone_stack_stats[i].code);
+            out[r].count = atomic_load(&cone_stack_stats[i].count);
+            out[r].stack = atomic_load(&cone_stack_stats[i].stack);
+            out[r].max = atomic_load(&cone_stack_stats[i].max);
+            for (size_t j = 0; j < 16; j++)
+                out[r].hist[j] = atomic_load_explicit(&cone_stack_stats[i].hist[j], memory_order_relaxed);
+            // Twice the observed maximum to leave room for signal handlers and untested paths.
+            out[r].suggest = (out[r].max * 2 + 4095) & ~(size_t)4095;
+        }
+        r++;
+    }
+    return r;
+}
+
+static void cone_unref(struct cone *c, struct cone_stacks *s) {
+    if (c && (atomic_fetch_xor(&c->flags, CONE_FLAG_LAST_REF) & CONE_FLAG_LAST_REF)) {
+        if ((c->flags & (CONE_FLAG_FAILED | CONE_FLAG_JOINED)) == CONE_FLAG_FAILED)
+            if (cone_error(c)->code != ECANCELED)
+                mun_error_show("cone destroyed with", cone_error(c));
+        cone_stacks_put(s, c);
+    }
+}
+
 static void cone_run(struct cone *c) {
-    struct mun_error *ep = mun_set_error_storage(&c->error);
+    struct mun_error *ep = mun_set_error_storage(cone_error(c));
     struct cone *prev = cone;
+    #if CONE_ASAN
+        const void *stack = c->target_stack;
+        size_t stack_size = c->target_stack_size;
+    #endif
     cone_switch(cone = c);
+    if (cone != c) { // see `cone_transfer`
+        #if CONE_ASAN
+            // `cone_switch` came back from `cone`'s stack, not `c`'s.
+            cone->target_stack = c->target_stack;
+            cone->target_stack_size = c->target_stack_size;
+            c->target_stack = stack;
+            c->target_stack_size = stack_size;
+        #endif
+        c = cone;
+    }
     cone = prev;
     mun_set_error_storage(ep);
-    if (c->flags & CONE_FLAG_FINISHED)
+    if (c->loop->handoff)
+        cone_runq_add_local(&c->loop->now, &c->loop->handoff->runq), c->loop->handoff = NULL;
+    unsigned flags = atomic_load_explicit(&c->flags, memory_order_relaxed);
+    if (flags & CONE_FLAG_FINISHED) {
+        if (flags & CONE_FLAG_TRACKED)
+            cone_stack_record(c);
         // Must be done after switching back to avoid use-after-free on a detached coroutine.
-        cone_drop(c);
+        cone_unref(c, &c->loop->stacks);
+    }
 }
 
-static struct cone *cone_spawn_on(struct cone_loop *loop, size_t size, struct cone_closure body) {
-    size = (size + CONE_STACK_ALIGN - 1) & ~(size_t)(CONE_STACK_ALIGN - 1);
-    struct cone *c = (struct cone *)malloc(sizeof(struct cone) + size);
-    if (c == NULL)
-        return (void)mun_error(ENOMEM, "no space for a stack"), NULL;
+static int cone_check_closure(size_t size, struct cone_closure body) {
+    if (body.size + 4 * sizeof(void *) > size)
+        return mun_error(EINVAL, "closure does not fit on a %zu byte stack", size);
+    return 0;
+}
+
+// Set up a block of memory as a new coroutine; the caller queues it and counts it as active.
+static void cone_init(struct cone *c, struct cone_loop *loop, size_t size, struct cone_closure body) {
     c->flags = CONE_FLAG_SCHEDULED;
+    c->pins = 0;
+    c->deadlines = NULL;
+    c->size = size;
+    #if CONE_ASAN
+        // A reused stack still has redzones of the previous coroutine's frames.
+        __asan_unpoison_memory_region((char *)c - size, size);
+    #endif
+    if (atomic_load_explicit(&cone_stack_tracking, memory_order_relaxed))
+        memset((char *)c - size, CONE_STACK_POISON, size), c->flags |= CONE_FLAG_TRACKED;
+    char *top = (char *)c;
+    if (body.size) {
+        top -= (body.size + CONE_STACK_ALIGN - 1) & ~(size_t)(CONE_STACK_ALIGN - 1);
+        body.move(top, body.data);
+        body.data = top;
+    }
     c->loop = loop;
-    c->body = body;
+    c->body.code = body.code;
+    c->body.data = body.data;
     c->done = (struct cone_event){};
+    c->joined = (struct cone_local_event){};
     #if CONE_ASAN
-        c->target_stack = c->stack;
+        c->target_stack = (char *)c - size;
         c->target_stack_size = size;
     #endif
-    c->rsp = (void **)&c->stack[size] - 4;
+    c->rsp = (void **)top - 4;
     c->rsp[0] = c;                  // first argument
     c->rsp[1] = NULL;               // frame pointer
     c->rsp[2] = (void*)&cone_body;  // program counter
     c->rsp[3] = NULL;               // return address (not actually used, but it terminates debugger stacks)
+}
+
+// `flags` are set on the coroutine before anything else can see it.
+static struct cone *cone_spawn_on(struct cone_loop *loop, size_t size, struct cone_closure body, unsigned flags) {
+    size = cone_stack_size(size);
+    if (cone_check_closure(size, body) MUN_RETHROW)
+        return NULL;
+    struct cone *c = cone_stacks_get(cone ? &cone->loop->stacks : NULL, size);
+    if (c == NULL)
+        return (void)mun_error(ENOMEM, "no space for a stack"), NULL;
+    cone_init(c, loop, size, body);
+    c->flags |= flags;
     atomic_fetch_add_explicit(&loop->active, 1, memory_order_release);
-    cone_runq_add(&loop->now, &c->runq);
+    if (loop->group)
+        atomic_fetch_add_explicit(&loop->group->active, 1, memory_order_release);
+    loop == cone_runq_owner ? cone_runq_add_local(&loop->now, &c->runq) : cone_runq_add(&loop->now, &c->runq);
     return c;
 }
 
 struct cone *cone_spawn(size_t size, struct cone_closure body) {
-    return cone_spawn_on(cone->loop, size, body);
+    return cone_spawn_on(cone->loop, size, body, 0);
+}
+
+int cone_spawn_n(size_t n, size_t size, const struct cone_closure *bodies, struct cone **out) {
+    struct cone_loop *loop = cone->loop;
+    size = cone_stack_size(size);
+    for (size_t i = 0; i < n; i++)
+        if (cone_check_closure(size, bodies[i]) MUN_RETHROW)
+            return -1;
+    if (!n)
+        return 0;
+    if (cone_stacks_get_n(&loop->stacks, size, n, out))
+        return mun_error(ENOMEM, "no space for %zu stacks", n);
+    for (size_t i = 0; i < n; i++) {
+        cone_init(out[i], loop, size, bodies[i]);
+        if (i)
+            atomic_store_explicit(&out[i - 1]->runq.next, &out[i]->runq, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&loop->active, n, memory_order_release);
+    if (loop->group)
+        atomic_fetch_add_explicit(&loop->group->active, n, memory_order_release);
+    cone_runq_add_local_chain(&loop->now, &out[0]->runq, &out[n - 1]->runq);
+    return 0;
 }
 
 struct cone *cone_spawn_at(struct cone *c, size_t size, struct cone_closure body) {
-    struct cone *n = cone_spawn_on(c->loop, size, body);
+    struct cone *n = cone_spawn_on(c->loop, size, body, 0);
     if (!n MUN_RETHROW)
         return NULL;
     cone_event_io_ping(&n->loop->io);
@@ -555,40 +1404,50 @@ struct cone *cone_spawn_at(struct cone *c, size_t size, struct cone_closure body
 }
 
 void cone_drop(struct cone *c) {
-    if (c && (atomic_fetch_xor(&c->flags, CONE_FLAG_LAST_REF) & CONE_FLAG_LAST_REF)) {
-        if ((c->flags & (CONE_FLAG_FAILED | CONE_FLAG_JOINED)) == CONE_FLAG_FAILED)
-            if (c->error.code != ECANCELED)
-                mun_error_show("cone destroyed with", &c->error);
-        free(c);
-    }
+    cone_unref(c, cone ? &cone->loop->stacks : NULL);
+}
+
+// Mark a coroutine as scheduled; whoever succeeds must put it into its loop's run queue.
+static int cone_claim(struct cone *c, int flags) {
+    return !(atomic_fetch_or(&c->flags, CONE_FLAG_SCHEDULED | flags) & (CONE_FLAG_SCHEDULED | CONE_FLAG_FINISHED));
 }
 
 static struct cone_loop *cone_schedule(struct cone *c, int flags) {
-    if (atomic_fetch_or(&c->flags, CONE_FLAG_SCHEDULED | flags) & (CONE_FLAG_SCHEDULED | CONE_FLAG_FINISHED))
+    if (!cone_claim(c, flags))
         return NULL; // loop is already aware of this, don't ping
-    struct cone_loop *loop = cone && cone->loop == c->loop ? NULL : c->loop;
+    struct cone_loop *loop = c->loop;
+    if (loop == cone_runq_owner)
+        return cone_runq_add_local(&loop->now, &c->runq), NULL;
     // This may cause the coroutine to be destroyed concurrently by its loop.
     // Meaning, accessing `c->loop` after the call returns is unsafe.
-    cone_runq_add(&c->loop->now, &c->runq);
+    cone_runq_add(&loop->now, &c->runq);
     return loop;
 }
 
-static int cone_deschedule(struct cone *c) {
+// Sleep until woken, running `to` (if not NULL; see `cone_transfer`) instead of returning
+// to the loop the first time. If woken before that, `to` is queued instead.
+static int cone_deschedule_to(struct cone *c, struct cone *to) {
     // CONE_FLAG_NO_INTR can only be set by the same thread, so the mask only needs to be computed once.
     unsigned flags = atomic_load_explicit(&c->flags, memory_order_relaxed);
     unsigned mask = CONE_FLAG_WOKEN | (flags & CONE_FLAG_NO_INTR ? 0 : CONE_FLAG_CANCELLED | CONE_FLAG_TIMED_OUT);
     while (!((flags = atomic_fetch_and(&c->flags, ~mask)) & mask))
         if (atomic_compare_exchange_weak(&c->flags, &flags, flags & ~CONE_FLAG_SCHEDULED))
-            cone_switch(c);
+            to ? cone_transfer(c, to) : cone_switch(c), to = NULL;
+    if (to)
+        cone_runq_add_local(&to->loop->now, &to->runq);
     return flags & mask & CONE_FLAG_CANCELLED ? mun_error(ECANCELED, "blocking call aborted")
          : flags & mask & CONE_FLAG_TIMED_OUT ? mun_error(ETIMEDOUT, "blocking call timed out") : 0;
 }
 
+static int cone_deschedule(struct cone *c) {
+    return cone_deschedule_to(c, NULL);
+}
+
 #ifndef CONE_SPIN_INTERVAL
 #define CONE_SPIN_INTERVAL 512
 #endif
 
-static inline void arch_pause() {
+static inline void arch_pause(void) {
     #if CONE_ASM_X64
         __asm__ __volatile__("pause");
     #elif CONE_ASM_ARM64
@@ -661,8 +1520,24 @@ intptr_t cone_tx_wait(struct cone_event *ev) {
     return it.v;
 }
 
+// Wakeups of coroutines on other loops are linked into one chain per loop while the event
+// is locked, then each chain is pushed with a single exchange and announced with a single ping.
+struct cone_wake_batch {
+    struct cone_loop *loop;
+    struct cone_runq_it *first, *last;
+};
+
+static void cone_wake_flush(struct cone_wake_batch *bs, size_t n) {
+    for (struct cone_wake_batch *b = bs; b != bs + n; b++) {
+        struct cone_loop *loop = b->loop; // the coroutines may be destroyed once pushed
+        cone_runq_add_chain(&loop->now, b->first, b->last);
+        cone_event_io_ping(&loop->io);
+    }
+}
+
 size_t cone_wake(struct cone_event *ev, size_t n, intptr_t ret) {
-    size_t r = 0;
+    size_t r = 0, k = 0;
+    struct cone_wake_batch bs[8];
     if (!n || !atomic_load_explicit(&ev->w, memory_order_acquire))
         return 0; // serialized before any `cone_tx_begin`
     cone_tx_lock(ev);
@@ -671,23 +1546,27 @@ size_t cone_wake(struct cone_event *ev, size_t n, intptr_t ret) {
         ev->head = it->next;
         it->next ? (it->next->prev = it->prev) : (ev->tail = it->prev);
         it->v = ret & INTPTR_MAX;
-        struct cone_loop *loop = cone_schedule(it->c, CONE_FLAG_WOKEN);
-        if (loop) {
-            int should_continue = n && ev->head;
-            // This unlock introduces an anomaly in `cone_cancel`: if A and B are waiting
-            // on this event and they are cancelled in the same order while we're busy
-            // pinging a loop of some coroutine between them, it'll look like B was
-            // cancelled before `cone_wake`, while A was cancelled after.
-            cone_tx_unlock(ev);
-            cone_event_io_ping(&loop->io);
-            if (!should_continue)
-                // Another item might have been added already, but we don't care, we
-                // pretend to see the old state.
-                return r + 1;
-            cone_tx_lock(ev);
+        struct cone *c = it->c;
+        if (!cone_claim(c, CONE_FLAG_WOKEN))
+            continue;
+        struct cone_loop *loop = c->loop;
+        if (loop == cone_runq_owner) {
+            cone_runq_add_local(&loop->now, &c->runq);
+            continue;
         }
+        // Until the chain is pushed, nothing else can schedule (or destroy) the coroutine.
+        size_t i = 0;
+        while (i < k && bs[i].loop != loop)
+            i++;
+        if (i == sizeof(bs) / sizeof(*bs))
+            cone_wake_flush(bs, k), i = k = 0;
+        if (i == k)
+            bs[k++] = (struct cone_wake_batch){loop, &c->runq, &c->runq};
+        else
+            atomic_store_explicit(&bs[i].last->next, &c->runq, memory_order_relaxed), bs[i].last = &c->runq;
     }
     cone_tx_unlock(ev);
+    cone_wake_flush(bs, k);
     return r;
 }
 
@@ -721,31 +1600,288 @@ int cone_unlock(struct cone_mutex *m, int fair) {
     return cone_wake(&m->e, 1, 2);
 }
 
+#ifndef NDEBUG
+#define cone_local_check(ev) \
+    mun_assert(!(ev)->head || (cone && (ev)->loop == cone->loop), "loop-local event used from another loop")
+#else
+#define cone_local_check(ev)
+#endif
+
+intptr_t cone_local_sleep(struct cone_local_event *ev) {
+    cone_local_check(ev);
+    struct cone_event_it it = { NULL, ev->tail, cone, -1 };
+    ev->tail ? (it.prev->next = &it) : (ev->head = &it);
+    ev->tail = &it;
+    ev->loop = cone->loop;
+    if (cone_deschedule(cone) MUN_RETHROW) {
+        // Only this thread touches the event, so if no `cone_local_wake` has unlinked
+        // this entry yet, none ever will.
+        if (it.v < 0) {
+            it.prev ? (it.prev->next = it.next) : (ev->head = it.next);
+            it.next ? (it.next->prev = it.prev) : (ev->tail = it.prev);
+        }
+        return it.v < 0 ? -1 : ~it.v;
+    }
+    return it.v;
+}
+
+size_t cone_local_wake(struct cone_local_event *ev, size_t n, intptr_t ret) {
+    size_t r = 0;
+    cone_local_check(ev);
+    for (struct cone_event_it *it; n-- && (it = ev->head); r++) {
+        ev->head = it->next;
+        it->next ? (it->next->prev = it->prev) : (ev->tail = it->prev);
+        it->v = ret & INTPTR_MAX;
+        // Still has to be atomic, since `cone_cancel` may come from another thread.
+        cone_schedule(it->c, CONE_FLAG_WOKEN);
+    }
+    return r;
+}
+
+int cone_local_try_lock(struct cone_local_mutex *m) {
+    return m->lk ? mun_error(EAGAIN, "mutex already locked") : (m->lk = 1, 0);
+}
+
+int cone_local_lock(struct cone_local_mutex *m) {
+    intptr_t r = 0;
+    // 0 = free, 1 = fair handoff, 2 = retry (same as `cone_lock`)
+    if (m->lk)
+        while ((r = cone_local_wait(&m->e, m->lk)) == 2) {}
+    if (r < 0 MUN_RETHROW) {
+        if (r == ~1)
+            cone_local_unlock(m, 1);
+        if (r == ~2)
+            cone_local_wake(&m->e, 1, 2);
+        return -1;
+    }
+    m->lk = 1;
+    return 0;
+}
+
+int cone_local_unlock(struct cone_local_mutex *m, int fair) {
+    if (fair && cone_local_wake(&m->e, 1, 1))
+        return 1;
+    m->lk = 0;
+    return cone_local_wake(&m->e, 1, 2);
+}
+
+static int cone_io_flags(int write) {
+    return (write & CONE_IO_WRITE ? IO_W : IO_R) | (write & CONE_IO_ONE ? IO_ONE : 0);
+}
+
 int cone_iowait(int fd, int write) {
-    struct cone_event_fd ev = {.fd = fd, .flags = write ? IO_W : IO_R, .c = cone};
-    if (cone_event_io_add(&cone->loop->io, &ev) MUN_RETHROW)
+    struct cone_event_io *set = &cone->loop->io;
+    struct cone_event_fd ev = {.fd = fd, .flags = cone_io_flags(write), .c = cone};
+    int et = cone_event_io_is_et(set, fd);
+    if (et && set->fds.data[fd].flags & ev.flags)
+        // There was an edge since the last wait, so the fd may have become ready after all.
+        return set->fds.data[fd].flags &= ~ev.flags, 0;
+    if (cone_event_io_add(set, &ev) MUN_RETHROW)
         return -1;
-    if (cone_deschedule(cone) MUN_RETHROW)
-        return mun_cant_fail(cone_event_io_del(&cone->loop->io, &ev)), -1;
+    // An exclusive waiter that was chosen by an event but then interrupted has to pass
+    // the event on through this loop's fd table, so it may not move until that is done.
+    if (ev.flags & IO_ONE)
+        cone_pins(cone, 1);
+    int ret = cone_deschedule(cone) MUN_RETHROW;
+    if (&cone->loop->io != set)
+        // Woken by the fd (else the waiter would have kept it here), then moved to another
+        // loop, so there is nothing to undo. Leaving the edge flag alone only costs one
+        // spurious retry later.
+        return ret;
+    if (ret) {
+        int waiting = cone_event_io_del(set, &ev);
+        mun_cant_fail(waiting < 0);
+        if (!waiting && ev.flags & IO_ONE)
+            // This was the one exclusive waiter chosen by an event, so pass it on.
+            cone_event_io_schedule_all(set, fd, ev.flags & IO_RW);
+    } else if (et) {
+        // The caller will retry the syscall, which will see all edges up to now.
+        set->fds.data[fd].flags &= ~ev.flags;
+    }
+    if (ev.flags & IO_ONE)
+        cone_pins(cone, -1);
+    return ret;
+}
+
+union cone_poll_it {
+    struct cone_event_fd fd;
+    struct cone_event_it ev;
+};
+
+int cone_poll(struct cone_pollfd *ps, size_t n, mun_usec deadline) {
+    struct cone_event_io *set = &cone->loop->io;
+    size_t fired = 0, i = 0;
+    // Registered fds that saw an edge since the last wait may be ready already (see `cone_iowait`).
+    for (; i < n; i++) {
+        int fd = ps[i].fd, flags = cone_io_flags(ps[i].flags) & IO_RW;
+        if ((ps[i].ready = !ps[i].ev && cone_event_io_is_et(set, fd) && set->fds.data[fd].flags & flags))
+            set->fds.data[fd].flags &= ~flags, fired++;
+    }
+    if (fired)
+        return fired;
+    struct mun_vec(union cone_poll_it) its = mun_vec_init_static(union cone_poll_it, 8);
+    struct cone_timer tm = {.at = deadline, .c = cone, .index = CONE_TIMER_NONE};
+    int err = mun_vec_reserve(&its, n) MUN_RETHROW;
+    // Once one fd fires, the rest still reference this coroutine from this loop's fd table.
+    cone_pins(cone, 1);
+    for (i = 0; !err && i < n; i++) {
+        if (ps[i].ev) {
+            struct cone_event *ev = ps[i].ev;
+            struct cone_event_it *it = &its.data[i].ev;
+            cone_tx_begin(ev);
+            *it = (struct cone_event_it){NULL, ev->tail, cone, -1};
+            ev->tail ? (it->prev->next = it) : (ev->head = it);
+            ev->tail = it;
+            cone_tx_unlock(ev);
+        } else {
+            its.data[i].fd = (struct cone_event_fd){.fd = ps[i].fd, .flags = cone_io_flags(ps[i].flags), .c = cone};
+            if ((err = cone_event_io_add(set, &its.data[i].fd) MUN_RETHROW))
+                break;
+        }
+    }
+    if (!err && deadline != MUN_USEC_MAX)
+        err = cone_event_schedule_add(&cone->loop->at, &tm) MUN_RETHROW;
+    if (!err)
+        err = cone_deschedule(cone) MUN_RETHROW;
+    // Now take everything back, noting what was already woken. (`i` is how many were added.)
+    while (i--) {
+        if (ps[i].ev) {
+            struct cone_event *ev = ps[i].ev;
+            struct cone_event_it *it = &its.data[i].ev;
+            // Same as in `cone_tx_wait`, this has to lock even if it looks like it was woken.
+            cone_tx_lock(ev);
+            if (!(ps[i].ready = it->v >= 0)) {
+                atomic_fetch_sub_explicit(&ev->w, 1, memory_order_relaxed);
+                it->prev ? (it->prev->next = it->next) : (ev->head = it->next);
+                it->next ? (it->next->prev = it->prev) : (ev->tail = it->prev);
+            }
+            cone_tx_unlock(ev);
+        } else {
+            int fd = ps[i].fd, waiting = cone_event_io_del(set, &its.data[i].fd);
+            mun_cant_fail(waiting < 0);
+            if ((ps[i].ready = !waiting) && err && its.data[i].fd.flags & IO_ONE)
+                cone_event_io_schedule_all(set, fd, its.data[i].fd.flags & IO_RW); // pass it on
+            else if (!waiting && cone_event_io_is_et(set, fd))
+                set->fds.data[fd].flags &= ~its.data[i].fd.flags;
+        }
+        fired += ps[i].ready;
+    }
+    cone_event_schedule_del(&cone->loop->at, &tm);
+    cone_pins(cone, -1);
+    mun_vec_fini(&its);
+    // Anything that fired while this coroutine was already running must not wake the next wait.
+    atomic_fetch_and_explicit(&cone->flags, ~CONE_FLAG_WOKEN, memory_order_relaxed);
+    return err ? -1 : (int)fired;
+}
+
+int cone_ioring(const struct io_uring_sqe *sqe, int *res) {
+#if CONE_EV_URING
+    struct cone_event_io *set = &cone->loop->io;
+    struct cone_event_op op = {.c = cone};
+    if (cone_event_io_uring_submit(set, sqe, &op) MUN_RETHROW_OS)
+        return -1;
+    if (cone_deschedule(cone)) {
+        unsigned flag = errno == ECANCELED ? CONE_FLAG_CANCELLED : CONE_FLAG_TIMED_OUT;
+        if (!op.done) {
+            // The kernel may still be using the buffers, so the operation has to end first.
+            struct io_uring_sqe *cancel = cone_event_io_uring_sqe(set);
+            if (cancel)
+                *cancel = (struct io_uring_sqe){.opcode = IORING_OP_ASYNC_CANCEL, .fd = -1, .addr = (uintptr_t)&op,
+                                                .flags = IOSQE_CQE_SKIP_SUCCESS};
+            int restore = cone_intr(0);
+            while (!op.done)
+                cone_deschedule(cone);
+            cone_intr(restore);
+        }
+        if (op.res == -ECANCELED)
+            return -1;
+        // Too late, it already happened. Let the next blocking call fail instead.
+        atomic_fetch_or(&cone->flags, flag);
+    }
+    return *res = op.res, 0;
+#else
+    return (void)sqe, (void)res, mun_error(ENOSYS, "not built with CONE_EV_URING");
+#endif
+}
+
+int cone_fd_register(int fd) {
+    if (cone_event_io_register(&cone->loop->io, fd) MUN_RETHROW)
+        return -1;
+    // Which coroutine will unregister the fd is anyone's guess, so this one stays put for good.
+    atomic_fetch_or_explicit(&cone->flags, CONE_FLAG_PINNED, memory_order_relaxed);
     return 0;
 }
 
+int cone_fd_unregister(int fd) {
+    return cone_event_io_unregister(&cone->loop->io, fd) MUN_RETHROW;
+}
+
 int cone_sleep_until(mun_usec t) {
-    if (cone_event_schedule_add(&cone->loop->at, t, cone, 0) MUN_RETHROW)
+    struct cone_timer tm = {.at = t, .c = cone};
+    if (cone_event_schedule_add(&cone->loop->at, &tm) MUN_RETHROW)
         return -1;
     if (cone_deschedule(cone) MUN_RETHROW)
-        return cone_event_schedule_del(&cone->loop->at, t, cone, 0), -1;
+        return cone_event_schedule_del(&cone->loop->at, &tm), -1;
+    return 0;
+}
+
+// Claim a coroutine for `cone_transfer`, or set it to NULL if it is already queued and
+// the caller should go through the loop instead.
+static int cone_handoff_claim(struct cone **c) {
+    struct cone_loop *loop = cone->loop;
+    if (*c == NULL)
+        return 0;
+    if (*c == cone)
+        return mun_error(EDEADLK, "coroutine switching to itself");
+    if ((*c)->loop != loop)
+        return mun_error(EINVAL, "coroutine is on another loop");
+    if (*c == loop->handoff)
+        return loop->handoff = NULL, 0; // runnable, but not queued
+    unsigned flags = atomic_load_explicit(&(*c)->flags, memory_order_relaxed);
+    if (flags & CONE_FLAG_FINISHED || !(flags & (CONE_FLAG_PARKED | CONE_FLAG_SCHEDULED)))
+        return mun_error(EINVAL, "coroutine is not waiting for a switch");
+    if (!(flags & CONE_FLAG_PARKED) || !cone_claim(*c, CONE_FLAG_WOKEN))
+        *c = NULL;
     return 0;
 }
 
+int cone_switch_to(struct cone *c) {
+    if (cone_handoff_claim(&c) MUN_RETHROW)
+        return -1;
+    atomic_fetch_or_explicit(&cone->flags, CONE_FLAG_PARKED, memory_order_relaxed);
+    int ret = cone_deschedule_to(cone, c);
+    atomic_fetch_and_explicit(&cone->flags, ~CONE_FLAG_PARKED, memory_order_relaxed);
+    return ret MUN_RETHROW;
+}
+
+int cone_yield_to(struct cone *c) {
+    struct cone_loop *loop = cone->loop;
+    if (cone_handoff_claim(&c) MUN_RETHROW)
+        return -1;
+    if (loop->handoff)
+        cone_runq_add_local(&loop->now, &loop->handoff->runq);
+    loop->handoff = cone;
+    c ? cone_transfer(cone, c) : cone_switch(cone);
+    // Still scheduled, so only need to check for interruptions, same as `cone_deschedule`.
+    unsigned mask = atomic_load_explicit(&cone->flags, memory_order_relaxed) & CONE_FLAG_NO_INTR ? 0 : CONE_FLAG_CANCELLED | CONE_FLAG_TIMED_OUT;
+    unsigned flags = mask ? atomic_fetch_and(&cone->flags, ~mask) & mask : 0;
+    return flags & CONE_FLAG_CANCELLED ? mun_error(ECANCELED, "blocking call aborted")
+         : flags & CONE_FLAG_TIMED_OUT ? mun_error(ETIMEDOUT, "blocking call timed out") : 0;
+}
+
 int cone_cowait(struct cone *c, int norethrow) {
     if (c == cone) // maybe detect more complicated deadlocks too?..
         return mun_error(EDEADLK, "coroutine waiting on itself");
-    if (!(c->flags & CONE_FLAG_FINISHED) && cone_wait(&c->done, !(c->flags & CONE_FLAG_FINISHED)) MUN_RETHROW)
+    // Without work stealing, a coroutine on this loop will finish on this loop, so there is
+    // nothing to synchronize with.
+    struct cone_loop *loop = cone->loop;
+    int local = c->loop == loop && !(loop->group && loop->group->flags & CONE_GROUP_STEAL);
+    if (!(c->flags & CONE_FLAG_FINISHED) && (local ? cone_local_wait(&c->joined, !(c->flags & CONE_FLAG_FINISHED))
+                                                   : cone_wait(&c->done, !(c->flags & CONE_FLAG_FINISHED))) MUN_RETHROW)
         return -1;
     // XXX the ordering here doesn't actually matter.
     if (!norethrow && atomic_fetch_or(&c->flags, CONE_FLAG_JOINED) & CONE_FLAG_FAILED)
-        return *mun_last_error() = c->error, mun_error_up(MUN_CURRENT_FRAME);
+        return *mun_last_error() = *cone_error(c), mun_error_up(MUN_CURRENT_FRAME);
     return 0;
 }
 
@@ -762,13 +1898,80 @@ void cone_cancel(struct cone *c) {
         cone_event_io_ping(&loop->io);
 }
 
+int cone_deadline_set(struct cone *c, struct cone_timer *tm, mun_usec t) {
+    *tm = (struct cone_timer){.at = t, .c = c, .deadline = 1};
+    return cone_event_schedule_add(&c->loop->at, tm) MUN_RETHROW;
+}
+
+void cone_deadline_clear(struct cone_timer *tm) {
+    // If it has already fired, the coroutine may have moved to a different loop since.
+    if (tm->index != CONE_TIMER_NONE)
+        cone_event_schedule_del(&tm->c->loop->at, tm);
+}
+
 int cone_deadline(struct cone *c, mun_usec t) {
-    // XXX were the user required to supply a storage, this could be a bst...
-    return cone_event_schedule_add(&c->loop->at, t, c, 1) MUN_RETHROW;
+    struct cone_timer *tm = malloc(sizeof(struct cone_timer));
+    if (tm == NULL)
+        return mun_error(ENOMEM, "could not allocate a timer");
+    if (cone_deadline_set(c, tm, t) MUN_RETHROW)
+        return free(tm), -1;
+    tm->next = c->deadlines;
+    c->deadlines = tm;
+    return 0;
 }
 
 void cone_complete(struct cone *c, mun_usec t) {
-    cone_event_schedule_del(&c->loop->at, t, c, 1);
+    for (struct cone_timer **it = &c->deadlines; *it; it = &(*it)->next) {
+        if ((*it)->at == t) {
+            struct cone_timer *tm = *it;
+            *it = tm->next;
+            return cone_deadline_clear(tm), free(tm);
+        }
+    }
+}
+
+int cone_pin(int enable) {
+    int prev = enable ? atomic_fetch_or_explicit(&cone->flags, CONE_FLAG_PINNED, memory_order_relaxed)
+                      : atomic_fetch_and_explicit(&cone->flags, ~CONE_FLAG_PINNED, memory_order_relaxed);
+    return !!(prev & CONE_FLAG_PINNED);
+}
+
+size_t cone_stack_cache(size_t limit) {
+    if (!cone)
+        return 0;
+    size_t prev = cone->loop->stacks.limit;
+    cone->loop->stacks.limit = limit;
+    cone_stacks_trim(&cone->loop->stacks);
+    return prev;
+}
+
+mun_usec cone_now(void) {
+    return cone ? cone->loop->clock : mun_usec_monotonic();
+}
+
+mun_usec cone_timer_slack(mun_usec slack) {
+    if (!cone)
+        return 0;
+    mun_usec prev = cone->loop->at.slack;
+    cone->loop->at.slack = slack;
+    return prev;
+}
+
+void cone_loop_stats(struct cone_loop_stats *st) {
+    if (!cone)
+        return (void)(*st = (struct cone_loop_stats){});
+    struct cone_loop *loop = cone->loop;
+    *st = (struct cone_loop_stats){loop->wakeups, loop->at.wakeups, loop->at.expiries,
+                                   loop->spin.time, loop->spin.hits, loop->spin.misses};
+}
+
+mun_usec cone_busy_poll(mun_usec limit) {
+    if (!cone)
+        return 0;
+    struct cone_loop *loop = cone->loop;
+    mun_usec prev = loop->spin.limit;
+    loop->spin.limit = loop->spin.budget = limit;
+    return prev;
 }
 
 const CONE_ATOMIC(unsigned) *cone_count(void) {
@@ -787,14 +1990,186 @@ struct cone *cone_loop(size_t size, struct cone_closure body, int (*run)(struct
     struct cone_loop *loop = calloc(sizeof(struct cone_loop), 1);
     if (loop == NULL || cone_loop_init(loop) MUN_RETHROW_OS)
         return free(loop), NULL;
-    struct cone *c = cone_spawn_on(loop, size, body);
+    struct cone *c = cone_spawn_on(loop, size, body, 0);
     if (c == NULL MUN_RETHROW)
         return free(loop), NULL;
     if (run(cone_bind(&cone_fork, loop)) MUN_RETHROW)
-        return free(loop), free(c), NULL;
+        return free(loop), cone_stack_free(c), NULL;
     return c;
 }
 
+// Move about half of the runnable coroutines that can be moved to a hungry sibling.
+static void cone_group_shed(struct cone_loop *loop, struct cone_loop *to) {
+    struct cone_runq_it *keep = NULL, *last = NULL;
+    struct cone *c;
+    size_t moved = 0;
+    for (size_t i = 0; i < 256 && (c = cone_runq_next(&loop->now)); i++) {
+        if (i % 2 == 0 || c->pins || atomic_load_explicit(&c->flags, memory_order_relaxed) & CONE_FLAG_PINNED) {
+            // These are linked locally so that they aren't popped again in this loop.
+            atomic_store_explicit(&c->runq.next, NULL, memory_order_relaxed);
+            last ? atomic_store_explicit(&last->next, &c->runq, memory_order_relaxed) : (keep = &c->runq);
+            last = &c->runq;
+            continue;
+        }
+        // The coroutine is scheduled, so nothing else reads `loop` until it runs again,
+        // and the run queue push makes the write visible to the new loop.
+        c->loop = to;
+        atomic_fetch_add_explicit(&to->active, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&loop->active, 1, memory_order_relaxed);
+        cone_runq_add(&to->now, &c->runq);
+        moved++;
+    }
+    while (keep) {
+        struct cone_runq_it *it = keep;
+        keep = atomic_load_explicit(&it->next, memory_order_relaxed);
+        cone_runq_add_local(&loop->now, it);
+    }
+    if (moved)
+        cone_event_io_ping(&to->io);
+    else // nothing to give after all, so let someone else try
+        atomic_store(&to->hungry, 1), atomic_fetch_add(&loop->group->hungry, 1);
+}
+
+static void cone_group_feed(struct cone_loop *loop) {
+    struct cone_group *g = loop->group;
+    if (cone_runq_is_empty(&loop->now))
+        return;
+    if (atomic_load_explicit(&loop->hungry, memory_order_relaxed) && atomic_exchange(&loop->hungry, 0))
+        atomic_fetch_sub(&g->hungry, 1); // found something to do by itself
+    if (!atomic_load_explicit(&g->hungry, memory_order_relaxed))
+        return;
+    for (unsigned i = 1; i < g->size; i++) {
+        struct cone_loop *to = &g->loops[(loop - g->loops + i) % g->size];
+        if (atomic_load_explicit(&to->hungry, memory_order_relaxed) && atomic_exchange(&to->hungry, 0))
+            return atomic_fetch_sub(&g->hungry, 1), cone_group_shed(loop, to);
+    }
+}
+
+static void cone_group_unref(struct cone_group *g) {
+    if (atomic_fetch_sub_explicit(&g->refs, 1, memory_order_acq_rel) == 1)
+        pthread_cond_destroy(&g->cv), pthread_mutex_destroy(&g->lk), free(g);
+}
+
+// Bind the calling thread to the `i`th (modulo their number) CPU it is allowed to run on.
+// Best effort: if the affinity cannot be changed, the thread just runs wherever.
+static void cone_group_pin_cpu(unsigned i) {
+    #ifdef __linux__
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) || !CPU_COUNT(&set))
+            return;
+        for (int cpu = 0, n = i % CPU_COUNT(&set); cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set) && !n--) {
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                sched_setaffinity(0, sizeof(set), &set);
+                return;
+            }
+        }
+    #else
+        (void)i;
+    #endif
+}
+
+static int cone_group_fork(struct cone_loop *loop) {
+    struct cone_group *g = loop->group;
+    if (g->flags & CONE_GROUP_PIN)
+        cone_group_pin_cpu(loop - g->loops);
+    cone_loop_run(loop);
+    if (atomic_fetch_sub(&g->running, 1) == 1) {
+        cone_wake(&g->done, (size_t)-1, 0);
+        pthread_mutex_lock(&g->lk);
+        pthread_cond_broadcast(&g->cv);
+        pthread_mutex_unlock(&g->lk);
+    }
+    return cone_group_unref(g), 0;
+}
+
+struct cone_group *cone_group(unsigned n, int flags, int (*run)(struct cone_closure)) {
+    if (n == 0)
+        return (void)mun_error(EINVAL, "a group needs at least one event loop"), NULL;
+    struct cone_group *g = calloc(sizeof(struct cone_group) + n * sizeof(struct cone_loop), 1);
+    if (g == NULL)
+        return (void)mun_error(ENOMEM, "could not allocate %u event loops", n), NULL;
+    g->lk = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    g->cv = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+    g->flags = flags;
+    g->size = n;
+    g->active = 1;
+    g->running = n;
+    g->refs = n + 1;
+    for (unsigned i = 0; i < n; i++) {
+        g->loops[i].group = g;
+        if (cone_loop_init(&g->loops[i]) MUN_RETHROW) {
+            while (i--)
+                cone_event_io_fini(&g->loops[i].io);
+            return free(g), NULL;
+        }
+    }
+    unsigned started = 0;
+    while (started < n && !(run(cone_bind(&cone_group_fork, &g->loops[started])) MUN_RETHROW))
+        started++;
+    if (started == n)
+        return g;
+    // The loops that did start will exit after the release, and the last one frees the group.
+    for (unsigned i = started; i < n; i++)
+        cone_event_io_fini(&g->loops[i].io), atomic_fetch_sub(&g->running, 1), cone_group_unref(g);
+    cone_group_release(g);
+    cone_group_unref(g);
+    return NULL;
+}
+
+static struct cone *cone_spawn_in_flags(struct cone_group *g, unsigned i, size_t size, struct cone_closure body, unsigned flags) {
+    struct cone *c = cone_spawn_on(&g->loops[i % g->size], size, body, flags);
+    if (!c MUN_RETHROW)
+        return NULL;
+    cone_event_io_ping(&g->loops[i % g->size].io);
+    return c;
+}
+
+struct cone *cone_spawn_in(struct cone_group *g, unsigned i, size_t size, struct cone_closure body) {
+    return cone_spawn_in_flags(g, i, size, body, 0);
+}
+
+struct cone *cone_spawn_pinned(struct cone_group *g, unsigned i, size_t size, struct cone_closure body) {
+    return cone_spawn_in_flags(g, i, size, body, CONE_FLAG_PINNED);
+}
+
+struct cone *cone_spawn_balanced(struct cone_group *g, size_t size, struct cone_closure body) {
+    // Rotate the starting point so that ties (e.g. all loops idle) are spread evenly.
+    unsigned start = atomic_fetch_add_explicit(&g->next, 1, memory_order_relaxed) % g->size;
+    struct cone_loop *best = &g->loops[start];
+    unsigned best_n = atomic_load_explicit(&best->active, memory_order_relaxed);
+    mun_usec best_d = atomic_load_explicit(&best->now.delay, memory_order_relaxed);
+    for (unsigned i = 1; i < g->size; i++) {
+        struct cone_loop *loop = &g->loops[(start + i) % g->size];
+        unsigned n = atomic_load_explicit(&loop->active, memory_order_relaxed);
+        mun_usec d = atomic_load_explicit(&loop->now.delay, memory_order_relaxed);
+        if (n < best_n || (n == best_n && d < best_d))
+            best = loop, best_n = n, best_d = d;
+    }
+    return cone_spawn_in(g, best - g->loops, size, body);
+}
+
+unsigned cone_group_size(struct cone_group *g) {
+    return g->size;
+}
+
+void cone_group_join(struct cone_group *g) {
+    if (cone) {
+        int restore = cone_intr(0);
+        cone_group_release(g);
+        cone_wait(&g->done, atomic_load(&g->running) != 0);
+        cone_intr(restore);
+    } else {
+        cone_group_release(g);
+        pthread_mutex_lock(&g->lk);
+        while (atomic_load(&g->running))
+            pthread_cond_wait(&g->cv, &g->lk);
+        pthread_mutex_unlock(&g->lk);
+    }
+    cone_group_unref(g);
+}
+
 static int cone_main_run(struct cone_loop *loop) {
     return cone_loop_run(loop), 0;
 }
@@ -803,7 +2178,7 @@ static struct cone_loop cone_main_loop = {};
 
 static void __attribute__((constructor)) cone_main_init(void) {
     mun_cant_fail(cone_loop_init(&cone_main_loop) MUN_RETHROW);
-    struct cone *c = cone_spawn_on(&cone_main_loop, CONE_DEFAULT_STACK, cone_bind(&cone_main_run, &cone_main_loop));
+    struct cone *c = cone_spawn_on(&cone_main_loop, CONE_DEFAULT_STACK, cone_bind(&cone_main_run, &cone_main_loop), 0);
     mun_cant_fail(c == NULL MUN_RETHROW);
     cone_switch(c); // the loop will then switch back because the coroutine is scheduled to run
 }
@@ -2,6 +2,17 @@
 #ifndef CONE_DEFAULT_STACK
 #define CONE_DEFAULT_STACK 65536
 #endif
+#ifndef CONE_STACK_CACHE
+#define CONE_STACK_CACHE 4194304
+#endif
+
+#ifndef CONE_TIMER_SLACK
+#define CONE_TIMER_SLACK 0
+#endif
+
+#ifndef CONE_BUSY_POLL
+#define CONE_BUSY_POLL 0
+#endif
 
 #include "mun.h"
 
@@ -19,9 +30,15 @@ extern "C" {
 struct cone_closure {
     int (*code)(void*);
     void *data;
+    // If nonzero, `code` is instead passed a pointer to `size` bytes at the top of the
+    // coroutine's stack (aligned for `max_align_t`), initialized by `move(them, data)` when
+    // the coroutine is created. Saves an allocation for closures that would otherwise go
+    // to the heap; cleaning up is then done by `code`. This space is taken from the stack.
+    size_t size;
+    void (*move)(void *, void *);
 };
 
-#define cone_bind(f, data) ((struct cone_closure){(int(*)(void*))f, data})
+#define cone_bind(f, data) ((struct cone_closure){(int(*)(void*))f, data, 0, NULL})
 
 // The coroutine in which the code is currently executing.
 #if __cplusplus && !__clang__
@@ -38,6 +55,11 @@ struct cone *cone_spawn(size_t stack, struct cone_closure);
 
 #define cone(f, arg) cone_spawn(CONE_DEFAULT_STACK, cone_bind(f, arg))
 
+// Like `cone_spawn`, but creates `n` coroutines at once and stores them in `out`. Stacks
+// that the loop has not cached are allocated as a single block, and the coroutines are
+// queued in one go, which makes fanning out cheaper. Either all are created or none are.
+int cone_spawn_n(size_t n, size_t stack, const struct cone_closure *, struct cone **out);
+
 // Like `cone_spawn`, but also creates a new event loop and passes to the provided function
 // a callback that runs it to completion. The loop terminates when all coroutines on it
 // finish. (The function can, for example, create a new detached thread.)
@@ -49,6 +71,46 @@ struct cone *cone_loop(size_t stack, struct cone_closure, int (*run)(struct cone
 // WARNING: the provided coroutine must not terminate until this call returns.
 struct cone *cone_spawn_at(struct cone *, size_t stack, struct cone_closure);
 
+// A set of event loops, each on its own thread, that can share coroutines.
+struct cone_group;
+
+enum {
+    // When a loop in the group runs out of things to do, it asks busier siblings to give
+    // it some of their runnable coroutines. A coroutine is never moved while it has some
+    // loop-bound state: it is waiting for I/O or sleeping, has a deadline set, or called
+    // `cone_pin` or `cone_fd_register`. Other thread-bound state (e.g. thread-locals)
+    // is not protected.
+    CONE_GROUP_STEAL = 0x1,
+    // Bind the `i`th loop's thread to the `i`th (modulo their number) CPU that the thread
+    // creating the group is allowed to run on. Linux only; elsewhere, and on failure, ignored.
+    CONE_GROUP_PIN = 0x2,
+};
+
+// Create `n` event loops, passing to `run` callbacks that run each of them (see `cone_loop`).
+// Unlike `cone_loop`, the loops do not terminate when they run out of coroutines, but wait
+// for new ones from `cone_spawn_in` until `cone_group_join` is called. May fail with ENOMEM,
+// errors from `run`, or anything else `cone_loop` can fail with.
+struct cone_group *cone_group(unsigned n, int flags, int (*run)(struct cone_closure));
+
+// Like `cone_spawn`, but starts the coroutine on the `i`th (modulo `n`) loop of a group.
+struct cone *cone_spawn_in(struct cone_group *, unsigned i, size_t stack, struct cone_closure);
+
+// Same as above, but the coroutine starts `cone_pin`ned, so it cannot be moved to another
+// loop even before it first runs.
+struct cone *cone_spawn_pinned(struct cone_group *, unsigned i, size_t stack, struct cone_closure);
+
+// Same as `cone_spawn_in`, but pick the loop with the fewest coroutines; if there are several,
+// the one with the lowest scheduling delay (see `cone_count` and `cone_delay`).
+struct cone *cone_spawn_balanced(struct cone_group *, size_t stack, struct cone_closure);
+
+// The number of event loops in a group.
+unsigned cone_group_size(struct cone_group *);
+
+// Allow the loops of a group to terminate once all coroutines on them finish, wait for
+// that, and free the group. Must be called exactly once, from a coroutine not in the group
+// or from a thread that runs no event loop (which then blocks). Uninterruptible.
+void cone_group_join(struct cone_group *);
+
 // Drop the reference to a coroutine returned by `cone_spawn`. No-op if the pointer is NULL.
 //
 // WARNING: calling this twice on the one pointer is effectively a double-free. Avoid that.
@@ -69,13 +131,54 @@ static inline int cone_join(struct cone *c, int norethrow) {
     return cone_drop(c), r;
 }
 
+// Flags for the second argument of `cone_iowait`.
+enum { CONE_IO_READ = 0, CONE_IO_WRITE = 1, CONE_IO_ONE = 2 };
+
 // Sleep until a file descriptor is ready for reading/writing. If it already is, equivalent
 // to `cone_yield`. This is only a best attempt; the action itself may still fail with
 // EAGAIN, e.g. if another coroutine already used the file descriptor while this one was in
 // the scheduler's run queue. If a call to this function is not inside a `while` loop,
 // you're almost certainly doing it wrong.
+//
+// With `CONE_IO_ONE`, the wait is exclusive: each event wakes only the longest-waiting
+// exclusive waiter (non-exclusive ones are still all woken), e.g. one of many coroutines
+// accepting on the same socket. If it does not consume everything, the next one is woken
+// on the next iteration, so it should keep going until EAGAIN. With epoll, if all waiters
+// on an fd are exclusive, so is its registration, meaning loops sharing it are woken one
+// at a time too.
 int cone_iowait(int fd, int write);
 
+// Keep a file descriptor in the running coroutine's event loop's poller in edge-triggered
+// mode instead of adding and removing it around each `cone_iowait`. The loop then tracks
+// which directions saw an edge, so that waits only park when the fd is known not to be
+// ready and cost no `epoll_ctl`/`kevent` calls. The fd should be non-blocking, and all
+// I/O on it should go through `cone_iowait`-based retry loops (e.g. `cold_*`). No-op with
+// select. May fail with EBUSY if some coroutine is already waiting on the fd.
+//
+// WARNING: the loop does not notice when the fd is closed, so call `cone_fd_unregister`
+// (or use `cold_close`) on the same loop first, else a new fd with the same number will
+// never wake anyone. For that reason, this `cone_pin`s the calling coroutine; in a
+// `CONE_GROUP_STEAL` group, any other coroutine that may close the fd should be pinned too.
+int cone_fd_register(int fd);
+
+// Undo `cone_fd_register`. No-op if the fd is not registered with this loop.
+int cone_fd_unregister(int fd);
+
+struct io_uring_sqe;
+
+// Submit an operation to the running coroutine's event loop's io_uring (its `user_data`
+// is overwritten) and sleep until it completes, then store the CQE's result, i.e. a value
+// or a negated errno. Unlike `cone_iowait`, this also works for regular files. If the sleep
+// is interrupted, the operation is cancelled and waited for; if it managed to complete
+// anyway, its result is returned and the next blocking call fails instead. Fails with
+// ENOSYS unless built with `CONE_EV_URING`.
+int cone_ioring(const struct io_uring_sqe *, int *res);
+
+// The monotonic clock as of the start of the current event loop iteration. Cheaper than
+// `mun_usec_monotonic`, but lags behind it by however long this iteration has taken so far.
+// Outside a coroutine, same as `mun_usec_monotonic`.
+mun_usec cone_now(void);
+
 // Sleep until at least the specified time, given by the monotonic clock (see
 // `mun_usec_monotonic`). Unlike normal system calls, does not interact with signals.
 // Clock jitter and scheduling delays apply.
@@ -90,9 +193,22 @@ static inline int cone_sleep(mun_usec t) {
 // some of them will be processed. If any coroutines are pending, they will all resume
 // before this coroutine.
 static inline int cone_yield(void) {
-    return cone_sleep_until(mun_usec_monotonic());
+    return cone_sleep_until(cone_now());
 }
 
+// Sleep until something switches back to this coroutine (or cancels it, etc.), running
+// the given one right away instead of returning to the event loop first. It must be on
+// the same loop and either sleeping in `cone_switch_to` or given way to with `cone_yield_to`;
+// if it is merely queued (e.g. has not started yet), it runs in its turn. A pair of
+// coroutines passing control back and forth with this, e.g. a generator and its consumer,
+// do not wait for the rest of the loop. With NULL, just sleeps. Fails with EINVAL if the
+// target is waiting for something else (an event, a timer, etc.) or has finished.
+int cone_switch_to(struct cone *);
+
+// Same as `cone_switch_to`, but this coroutine stays runnable, so if nothing switches back
+// to it, it resumes like after `cone_yield` once the other one sleeps.
+int cone_yield_to(struct cone *);
+
 // A manually triggered event. Must be zero-initialized.
 struct cone_event { void *head; void *tail; CONE_ATOMIC(void *) lk; CONE_ATOMIC(unsigned) w; };
 
@@ -140,6 +256,19 @@ intptr_t cone_tx_wait(struct cone_event *);
 // before *begin*; otherwise, *wait* happens-before *wake*.
 size_t cone_wake(struct cone_event *, size_t, intptr_t ret);
 
+// Something for `cone_poll` to wait on: if `ev` is NULL, `fd` becoming ready in the
+// direction given by `flags` (see `cone_iowait`), else the next `cone_wake` of `ev`.
+struct cone_pollfd { int fd; int flags; struct cone_event *ev; int ready; };
+
+// Sleep until at least one of `n` things is ready or the time (see `cone_sleep_until`)
+// comes, whichever is first, then set `ready` on the ones that are and return how many,
+// or 0 on timeout; pass `MUN_USEC_MAX` to wait forever. All of them are registered with
+// the loop while the coroutine sleeps only once, so e.g. pumping data both ways between
+// two sockets takes one coroutine instead of two. Same caveats as for `cone_iowait` apply.
+// Events woken at the same time as a cancellation are consumed, so on failure `ready`
+// is still set. May fail with ENOMEM if `n` is more than 8.
+int cone_poll(struct cone_pollfd *, size_t n, mun_usec deadline);
+
 // A coroutine-owned mutex. Must be zero-initialized.
 struct cone_mutex { struct cone_event e; CONE_ATOMIC(char) lk; };
 
@@ -155,6 +284,34 @@ int cone_lock(struct cone_mutex *);
 // was waiting to acquire this lock.
 int cone_unlock(struct cone_mutex *, int fair);
 
+// A `cone_event` that can only be used by coroutines of one event loop (in a
+// `CONE_GROUP_STEAL` group, they also have to be `cone_pin`ned), but skips all locking
+// and atomics. Must be zero-initialized. In debug builds, waiting on or waking it from
+// a different loop than the one the current waiters are on aborts.
+struct cone_local_event { void *head; void *tail; void *loop; };
+
+// Same as `cone_tx_wait`, except there is no transaction to finish: nothing else can run
+// between evaluating the condition and going to sleep anyway.
+intptr_t cone_local_sleep(struct cone_local_event *);
+
+// Same as `cone_wait`.
+#define cone_local_wait(ev, x) (!(x) ? 0 : cone_local_sleep(ev))
+
+// Same as `cone_wake`.
+size_t cone_local_wake(struct cone_local_event *, size_t, intptr_t ret);
+
+// A `cone_mutex` built on a `cone_local_event`; same restrictions apply.
+struct cone_local_mutex { struct cone_local_event e; char lk; };
+
+// Same as `cone_try_lock`.
+int cone_local_try_lock(struct cone_local_mutex *);
+
+// Same as `cone_lock`.
+int cone_local_lock(struct cone_local_mutex *);
+
+// Same as `cone_unlock`.
+int cone_local_unlock(struct cone_local_mutex *, int fair);
+
 // Enable or disable cancellation and deadlines for this coroutine. If disabled, their effect
 // is postponed until they are re-enabled. Returns the previous state.
 //
@@ -172,6 +329,10 @@ int cone_unlock(struct cone_mutex *, int fair);
 // before that object can be deallocated.
 int cone_intr(int enable);
 
+// Prevent (or allow) moving the current coroutine to a different event loop of the same
+// `CONE_GROUP_STEAL` group. Returns the previous state.
+int cone_pin(int enable);
+
 // Make the next (or current, if any) call to a blocking function from the specified
 // coroutine fail with ECANCELED.
 //
@@ -193,6 +354,87 @@ int cone_deadline(struct cone *, mun_usec);
 // Undo *one* previous call to `cone_deadline` with the *same* arguments.
 void cone_complete(struct cone *, mun_usec);
 
+// Storage for a deadline. Contents are private.
+struct cone_timer { mun_usec at; unsigned long long seq; size_t index; struct cone *c; int deadline; struct cone_timer *next; };
+
+// Same as `cone_deadline`, but with caller-provided storage for the timer. It must stay
+// where it is until passed to `cone_deadline_clear`, which does not have to search for it.
+int cone_deadline_set(struct cone *, struct cone_timer *, mun_usec);
+
+// Undo a `cone_deadline_set`. Same thread restriction applies.
+void cone_deadline_clear(struct cone_timer *);
+
+// Set the maximum total size (in bytes, including bookkeeping) of finished coroutines that
+// the running coroutine's event loop keeps around so that `cone_spawn` can reuse their
+// stacks instead of calling `malloc`. Coroutines dropped by a thread that is not running
+// an event loop are freed immediately; those dropped on a different loop are cached there.
+// 0 disables caching. Returns the previous limit. The default is `CONE_STACK_CACHE`.
+// Outside a coroutine, does nothing and returns 0.
+size_t cone_stack_cache(size_t);
+
+// Enable or disable stack usage tracking for coroutines spawned from now on. Returns the
+// previous state. While enabled, new stacks are filled with a known pattern, which costs
+// a `memset` per spawn and commits all of the memory of `mmap`ped stacks right away.
+int cone_stack_track(int enable);
+
+// How deep the stack of a tracked coroutine has been so far, in bytes; 0 if not tracked.
+// The coroutine must be either finished or on the current thread.
+size_t cone_stack_depth(struct cone *);
+
+// Stack usage of finished tracked coroutines that ran the same function.
+struct cone_stack_usage {
+    int (*code)(void *);
+    size_t count;
+    // The largest stack any of them had.
+    size_t stack;
+    // The deepest any of them has gone.
+    size_t max;
+    // `hist[i]` is how many of them went less than `1024 << i`, but at least `512 << i`,
+    // bytes deep. The first bin also counts shallower ones, the last one deeper ones.
+    size_t hist[16];
+    // A stack size to use instead of `stack`. Based on `max`, so only as good as the
+    // coverage of whatever workload was measured.
+    size_t suggest;
+};
+
+// Write statistics for up to `n` functions into an array. Returns the number of functions
+// for which statistics are available, which may be more than `n`.
+size_t cone_stack_usage(struct cone_stack_usage *, size_t n);
+
+// Allow timers on the running coroutine's event loop to fire up to `slack` microseconds
+// late. The loop then only wakes up for timers at multiples of `slack`, handling all
+// that expired since in one go. Applies to `cone_sleep_until` and deadlines alike.
+// Returns the previous value. The default is `CONE_TIMER_SLACK`. Outside a coroutine,
+// does nothing and returns 0.
+mun_usec cone_timer_slack(mun_usec slack);
+
+// Before waiting for I/O, timers, or pings, keep checking the running coroutine's event loop's
+// run queue and (without blocking) file descriptors for up to `limit` microseconds; this
+// trades CPU time for the latency of waking up. The actual spin time adapts to how often it
+// pays off. 0 disables. Returns the previous value. The default is `CONE_BUSY_POLL`.
+// Outside a coroutine, does nothing and returns 0.
+mun_usec cone_busy_poll(mun_usec limit);
+
+struct cone_loop_stats {
+    // How many times the loop had nothing to run and waited for I/O, timers, or pings.
+    size_t wakeups;
+    // How many of those waits ended with some timers expiring.
+    size_t timer_wakeups;
+    // The number of distinct times at which timers expired during those waits, i.e.
+    // how many wakeups there would have been without slack. `timer_expiries - timer_wakeups`
+    // is the number of wakeups saved by coalescing.
+    size_t timer_expiries;
+    // Time spent busy-polling (see `cone_busy_poll`), and how many times that found something
+    // to run vs. ended in a wait anyway. The former is CPU time that would otherwise be idle.
+    mun_usec spin_time;
+    size_t spin_hits;
+    size_t spin_misses;
+};
+
+// Get the counters of the running coroutine's event loop since it was created, or all
+// zeros outside a coroutine.
+void cone_loop_stats(struct cone_loop_stats *);
+
 // The live counter of coroutines active in the running coroutine's event loop.
 const CONE_ATOMIC(unsigned) *cone_count(void);
 
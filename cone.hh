@@ -13,12 +13,17 @@
 //     is not wrapped. On the other hand, there is some stuff that is C++-only, e.g guards.
 //
 #include "cone.h"
+#include "cold.h"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cstddef>
 #include <memory>
+#include <new>
 #include <vector>
 #include <thread>
+#include <utility>
 
 extern "C" char *__cxa_demangle(const char *, char *, size_t *, int *);
 
@@ -45,20 +50,39 @@ struct cone {
         cone_cancel(this);
     }
 
-    // `cone_deadline` and `cone_complete`, but in RAII form. Passing `time::max()`
+    // Pass control to this coroutine directly from the current one, which either sleeps
+    // until something switches back or stays runnable. See `cone_switch_to`.
+    bool switch_to() noexcept {
+        return !cone_switch_to(this);
+    }
+
+    bool yield_to() noexcept {
+        return !cone_yield_to(this);
+    }
+
+    // `cone_deadline_set` and `cone_deadline_clear`, but in RAII form. The timer is stored
+    // in the returned object, which therefore cannot be moved. Passing `time::max()`
     // as an argument makes this method a no-op, i.e. it returns some empty object.
     auto deadline(time t) noexcept {
-        struct deleter {
-            mun_usec t_;
+        struct scoped_deadline {
+            scoped_deadline(cone *c, time t) noexcept : armed_(t != time::max()) {
+                if (armed_)
+                    mun_cant_fail(cone_deadline_set(c, &timer_, mun_usec_chrono(t)) MUN_RETHROW);
+            }
+
+            scoped_deadline(const scoped_deadline&) = delete;
+            scoped_deadline& operator=(const scoped_deadline&) = delete;
 
-            void operator()(cone *c) noexcept {
-                cone_complete(c, t_);
+            ~scoped_deadline() {
+                if (armed_)
+                    cone_deadline_clear(&timer_);
             }
+
+        private:
+            bool armed_;
+            cone_timer timer_;
         };
-        if (t == time::max())
-            return std::unique_ptr<cone, deleter>{nullptr, deleter{0}};
-        mun_cant_fail(cone_deadline(this, mun_usec_chrono(t)) MUN_RETHROW);
-        return std::unique_ptr<cone, deleter>{this, deleter{mun_usec_chrono(t)}};
+        return scoped_deadline{this, t};
     }
 
     // Same as above, but relative to now. `timedelta::max()` is a no-op.
@@ -128,8 +152,7 @@ struct cone {
         template <typename F /* = bool() */,
                   typename G = std::enable_if_t<std::is_invocable_r<bool, F>::value, std::remove_reference_t<F>>>
         ref(F&& f, size_t stack = 100UL * 1024) noexcept {
-            // XXX if F is trivially copyable and fits into one `void*`, we can pass it by value.
-            reset(cone_spawn(stack, cone_bind(&invoke<G>, new G(std::forward<F>(f)))));
+            reset(cone_spawn(stack, closure<F, G>(f)));
             mun_cant_fail(!*this MUN_RETHROW);
         }
 
@@ -137,9 +160,32 @@ struct cone {
         template <typename F /* = bool() */,
                   typename G = std::enable_if_t<std::is_invocable_r<bool, F>::value, std::remove_reference_t<F>>>
         ref(cone* c, F&& f, size_t stack = 100UL * 1024) noexcept {
-            reset(cone_spawn_at(c, stack, cone_bind(&invoke<G>, new G(std::forward<F>(f)))));
+            reset(cone_spawn_at(c, stack, closure<F, G>(f)));
             mun_cant_fail(!*this MUN_RETHROW);
         }
+
+        // Same as above, but spawn on the `i`th loop of a group.
+        template <typename F /* = bool() */,
+                  typename G = std::enable_if_t<std::is_invocable_r<bool, F>::value, std::remove_reference_t<F>>>
+        ref(struct cone_group* g, unsigned i, F&& f, size_t stack = 100UL * 1024) noexcept {
+            reset(cone_spawn_in(g, i, stack, closure<F, G>(f)));
+            mun_cant_fail(!*this MUN_RETHROW);
+        }
+
+        // Spawn a coroutine for each function in a range, all at once (see `cone_spawn_n`).
+        template <typename R, typename F = decltype(*std::begin(std::declval<R&>())),
+                  typename G = std::remove_reference_t<F>>
+        static std::vector<ref> spawn_n(R&& fs, size_t stack = 100UL * 1024) noexcept {
+            std::vector<cone_closure> cs;
+            for (auto& f : fs)
+                cs.push_back(closure<F, G>(f));
+            std::vector<cone*> out(cs.size());
+            mun_cant_fail(cone_spawn_n(cs.size(), stack, cs.data(), out.data()) MUN_RETHROW);
+            std::vector<ref> rs(out.size());
+            for (size_t i = 0; i < out.size(); i++)
+                rs[i].reset(out[i]);
+            return rs;
+        }
     };
 
     // An owning reference to a coroutine in a separate thread. (Upcasting is OK.)
@@ -150,11 +196,60 @@ struct cone {
         // Any coroutine it spawns itself through `ref` will also be on that thread.
         template <typename F /* = bool() */, typename G = std::remove_reference_t<F>>
         thread(F&& f, size_t stack = 100UL * 1024) noexcept {
-            reset(cone_loop(stack, cone_bind(&invoke<G>, new G(std::forward<F>(f))), [](cone_closure c) {
-                return std::thread{[=](){ mun_cant_fail(c.code(c.data) MUN_RETHROW); }}.detach(), 0;
-            }));
+            reset(cone_loop(stack, closure<F, G>(f), &start));
             mun_cant_fail(!*this MUN_RETHROW);
         }
+
+        // Run an event loop on a new detached thread. See `cone_loop` and `cone_group`.
+        static int start(cone_closure c) noexcept {
+            return std::thread{[=](){ mun_cant_fail(c.code(c.data) MUN_RETHROW); }}.detach(), 0;
+        }
+    };
+
+    // A set of event loops on separate threads (see `cone_group`). Destroying it waits
+    // until all coroutines on it finish, blocking the thread if it runs no event loop.
+    struct pool {
+        // `flags` is a combination of `CONE_GROUP_STEAL` and `CONE_GROUP_PIN`.
+        pool(unsigned n = std::max(std::thread::hardware_concurrency(), 1u), int flags = 0) noexcept
+            : g_(cone_group(n, flags, &thread::start))
+        {
+            mun_cant_fail(!g_ MUN_RETHROW);
+        }
+
+        pool(const pool&) = delete;
+        pool& operator=(const pool&) = delete;
+
+        ~pool() {
+            join();
+        }
+
+        // Wait for all coroutines, then stop the loops. No-op if already joined.
+        void join() noexcept {
+            if (g_)
+                cone_group_join(std::exchange(g_, nullptr));
+        }
+
+        // Spawn a coroutine on the `i`th loop (modulo their number).
+        template <typename F /* = bool() */>
+        ref spawn(unsigned i, F&& f, size_t stack = 100UL * 1024) noexcept {
+            return ref{g_, i, std::forward<F>(f), stack};
+        }
+
+        // Spawn a coroutine on the least loaded loop (see `cone_spawn_balanced`).
+        template <typename F /* = bool() */, typename G = std::remove_reference_t<F>>
+        ref spawn_balanced(F&& f, size_t stack = 100UL * 1024) noexcept {
+            ref r;
+            r.reset(cone_spawn_balanced(g_, stack, closure<F, G>(f)));
+            mun_cant_fail(!r MUN_RETHROW);
+            return r;
+        }
+
+        struct cone_group* get() const noexcept {
+            return g_;
+        }
+
+    private:
+        struct cone_group* g_;
     };
 
     struct aborter {
@@ -177,6 +272,64 @@ struct cone {
         }
     };
 
+    // A `SO_REUSEPORT` socket with an acceptor on each loop of a pool (see `cold_listen_group`).
+    // Every connection is passed to a new coroutine on the same loop that calls a copy of
+    // `f(fd)`, which then owns the fd. Destroying this stops accepting new connections and
+    // waits for the acceptors, so unlike `pool`, it has to be done from a coroutine; check
+    // `operator bool` for errors.
+    struct listener {
+        listener() = default;
+
+        template <typename F /* = bool(int) */, typename G = std::remove_reference_t<F>>
+        listener(pool& p, const sockaddr* addr, socklen_t addrlen, int backlog, F&& f, size_t stack = 100UL * 1024) noexcept
+            : addrlen_(std::min(addrlen, socklen_t(sizeof(addr_))))
+        {
+            auto h = std::make_shared<handler<G>>(handler<G>{std::forward<F>(f), stack});
+            std::vector<cone*> cs(cone_group_size(p.get()));
+            memcpy(&addr_, addr, addrlen_);
+            if (cold_listen_group(p.get(), (sockaddr*)&addr_, &addrlen_, backlog, &handler<G>::accepted, h.get(), cs.data()))
+                return;
+            handler_ = std::move(h);
+            for (cone* c : cs)
+                acceptors_.emplace_back(c);
+        }
+
+        explicit operator bool() const noexcept {
+            return !acceptors_.empty();
+        }
+
+        // The address all sockets are bound to, with the port picked by the kernel if it was 0.
+        const sockaddr* address() const noexcept {
+            return (const sockaddr*)&addr_;
+        }
+
+        socklen_t address_size() const noexcept {
+            return addrlen_;
+        }
+
+    private:
+        template <typename G>
+        struct handler {
+            G f;
+            size_t stack;
+
+            static int accepted(void* ptr, int fd) noexcept {
+                auto h = static_cast<handler*>(ptr);
+                auto run = [f = h->f, fd]() mutable { return f(fd); };
+                struct cone* c = cone_spawn(h->stack, closure<decltype(run), decltype(run)>(run));
+                if (!c MUN_RETHROW)
+                    return close(fd), -1;
+                return cone_drop(c), 0;
+            }
+        };
+
+        sockaddr_storage addr_ = {};
+        socklen_t addrlen_ = 0;
+        std::shared_ptr<void> handler_;
+        // Declared last so that the acceptors are stopped before the handler is freed.
+        std::vector<std::unique_ptr<cone, aborter>> acceptors_;
+    };
+
     // A list of coroutines from which they remove themselves after terminating. Destroying
     // the list also cancels and uninterruptibly waits for all still-active coroutines.
     struct mguard {
@@ -309,6 +462,63 @@ struct cone {
         }
     };
 
+    // An `event` that can only be used by coroutines on one loop, but needs no locking.
+    struct local_event : cone_local_event {
+        using result = event::result;
+
+        local_event() noexcept : cone_local_event{} {}
+        local_event(const local_event&) = delete;
+        local_event& operator=(const local_event&) = delete;
+
+        // Sleep until the event happens.
+        result wait() noexcept { return result(cone_local_sleep(this)); }
+
+        // If the provided function returns `true`, sleep until the event happens,
+        // else successfully return immediately.
+        template <typename F /* = bool() noexcept */>
+        result wait_if(F&& f) noexcept { return result(cone_local_wait(this, f())); }
+
+        // Wake at most `n` coroutines currently waiting for this event with a value of 0.
+        size_t wake(size_t n = std::numeric_limits<size_t>::max()) noexcept { return wake_with(0, n); }
+
+        // Wake at most `n` coroutines currently waiting for this event with the provided value.
+        size_t wake_with(intptr_t value, size_t n = std::numeric_limits<size_t>::max()) noexcept {
+            return cone_local_wake(this, n, value);
+        }
+    };
+
+    // A `mutex` that can only be used by coroutines on one loop, but needs no locking.
+    struct local_mutex : cone_local_mutex {
+        local_mutex() noexcept : cone_local_mutex{} {}
+        local_mutex(const local_mutex&) = delete;
+        local_mutex& operator=(const local_mutex&) = delete;
+
+        enum { unfair = 0, uninterruptible = 0, fair = 1, interruptible = 2 };
+
+        bool try_lock() noexcept {
+            return !cone_local_try_lock(this);
+        }
+
+        bool lock(int flags = uninterruptible) noexcept {
+            return flags & interruptible ? !cone_local_lock(this) : cone::uninterruptible([this]{ return !cone_local_lock(this); });
+        }
+
+        bool unlock(int flags = unfair) noexcept {
+            return cone_local_unlock(this, !!(flags & fair));
+        }
+
+        auto guard(int flags = uninterruptible | unfair) noexcept {
+            struct deleter {
+                int flags;
+
+                void operator()(local_mutex *m) const {
+                    m->unlock(flags);
+                }
+            };
+            return std::unique_ptr<local_mutex, deleter>{lock(flags) ? this : nullptr, deleter{flags}};
+        }
+    };
+
     // An object that allows coroutines to pass when the required number of them are ready.
     struct barrier {
         barrier(size_t n) noexcept : v_(n) {}
@@ -353,6 +563,20 @@ private:
 
     template <typename F>
     static int invoke(void *ptr) noexcept {
-        return try_mun([&] { return (*std::unique_ptr<F>(reinterpret_cast<F*>(ptr)))(); }) ? 0 : -1;
+        struct destroy { F *f; ~destroy() { f->~F(); } } g{reinterpret_cast<F*>(ptr)};
+        return try_mun([&] { return (*g.f)(); }) ? 0 : -1;
+    }
+
+    template <typename F, typename G>
+    static void construct(void *dst, void *src) noexcept {
+        new (dst) G(std::forward<F>(*reinterpret_cast<std::remove_reference_t<F>*>(src)));
+    }
+
+    // The functor is constructed directly on the coroutine's stack, so `F&&` must stay
+    // valid until `cone_spawn` returns, which it does since that's where it is called from.
+    template <typename F, typename G>
+    static cone_closure closure(F& f) noexcept {
+        static_assert(alignof(G) <= alignof(std::max_align_t), "over-aligned functors are not supported");
+        return {&invoke<G>, (void*)std::addressof(f), sizeof(G), &construct<F, G>};
     }
 };
@@ -10,18 +10,123 @@
 #include <unistd.h>
 #include <sys/time.h>
 
+#ifndef MUN_TSC_CLOCK
+#define MUN_TSC_CLOCK 0
+#endif
+
+#if MUN_TSC_CLOCK && defined(__x86_64__)
+#include <cpuid.h>
+#include <stdatomic.h>
+#include <x86intrin.h>
+#else
+#undef MUN_TSC_CLOCK
+#define MUN_TSC_CLOCK 0
+#endif
+
 mun_usec mun_usec_now(void) {
     struct timespec val;
     clock_gettime(CLOCK_REALTIME, &val);
     return (mun_usec)val.tv_sec * 1000000ull + val.tv_nsec / 1000;
 }
 
-mun_usec mun_usec_monotonic(void) {
+static mun_usec mun_usec_monotonic_os(void) {
     struct timespec val;
     clock_gettime(CLOCK_MONOTONIC, &val);
     return (mun_usec)val.tv_sec * 1000000ull + val.tv_nsec / 1000;
 }
 
+#if MUN_TSC_CLOCK
+// How long to measure the TSC against `clock_gettime` before switching to it. The longer,
+// the less the jitter of either reading matters, i.e. the less the two clocks drift apart.
+#define MUN_TSC_CALIBRATION 1000000
+
+// How often to re-anchor the TSC to `clock_gettime` afterwards, so that NTP slewing
+// the latter does not make them diverge over time.
+#define MUN_TSC_RESYNC 1000000
+
+enum { MUN_TSC_NONE, MUN_TSC_BUSY, MUN_TSC_CALIBRATING, MUN_TSC_READY, MUN_TSC_UNSUPPORTED };
+
+static struct {
+    _Atomic(int) state;
+    _Atomic(unsigned) seq;            // odd while the next three fields are being updated
+    _Atomic(unsigned long long) tsc;
+    _Atomic(mun_usec) usec;           // the value of this clock at `tsc`
+    _Atomic(double) rate;             // microseconds per tick
+    unsigned long long os_tsc;        // the last `clock_gettime` reading and the TSC at the time;
+    mun_usec os_usec;                 // only accessed while `seq` is odd (or before MUN_TSC_READY)
+} mun_tsc;
+
+// The TSC is only usable if it ticks at a constant rate regardless of power states,
+// and the kernel keeps it in sync across cores; CPUID says if it's the former.
+static int mun_tsc_is_invariant(void) {
+    unsigned a, b, c, d;
+    return __get_cpuid(0x80000007, &a, &b, &c, &d) && d & (1u << 8);
+}
+
+static mun_usec mun_tsc_at(unsigned long long tsc) {
+    return atomic_load_explicit(&mun_tsc.usec, memory_order_relaxed) + (mun_usec)(
+        (double)(long long)(tsc - atomic_load_explicit(&mun_tsc.tsc, memory_order_relaxed)) *
+        atomic_load_explicit(&mun_tsc.rate, memory_order_relaxed));
+}
+
+// Move the anchor to now, and pick a rate that will bring this clock back to `clock_gettime`
+// by the next resync. The anchor is never behind the old line (plus a microsecond to cover
+// readers that raced with this), so time never goes backwards; thus this clock can only be
+// ahead of `clock_gettime`, and the new rate is never higher than the measured one.
+static void mun_tsc_resync(unsigned seq) {
+    if (!atomic_compare_exchange_strong(&mun_tsc.seq, &seq, seq + 1))
+        return; // someone else is already doing this
+    mun_usec os = mun_usec_monotonic_os();
+    unsigned long long tsc = __rdtsc();
+    mun_usec usec = mun_tsc_at(tsc) + 1;
+    if (usec < os)
+        usec = os;
+    double rate = (double)(os - mun_tsc.os_usec) / (double)(tsc - mun_tsc.os_tsc);
+    double lag = (double)(usec - os) / MUN_TSC_RESYNC;
+    mun_tsc.os_tsc = tsc;
+    mun_tsc.os_usec = os;
+    atomic_store_explicit(&mun_tsc.tsc, tsc, memory_order_relaxed);
+    atomic_store_explicit(&mun_tsc.usec, usec, memory_order_relaxed);
+    atomic_store_explicit(&mun_tsc.rate, rate * (lag < 0.5 ? 1 - lag : 0.5), memory_order_relaxed);
+    atomic_store_explicit(&mun_tsc.seq, seq + 2, memory_order_release);
+}
+
+mun_usec mun_usec_monotonic(void) {
+    int state = atomic_load_explicit(&mun_tsc.state, memory_order_acquire);
+    if (state == MUN_TSC_READY) {
+        unsigned seq;
+        mun_usec now;
+        do {
+            seq = atomic_load_explicit(&mun_tsc.seq, memory_order_acquire);
+            now = mun_tsc_at(__rdtsc());
+            atomic_thread_fence(memory_order_acquire);
+        } while (seq & 1 || seq != atomic_load_explicit(&mun_tsc.seq, memory_order_relaxed));
+        if (now - atomic_load_explicit(&mun_tsc.usec, memory_order_relaxed) >= MUN_TSC_RESYNC)
+            mun_tsc_resync(seq);
+        return now;
+    }
+    mun_usec now = mun_usec_monotonic_os();
+    if (state == MUN_TSC_NONE && atomic_compare_exchange_strong(&mun_tsc.state, &state, MUN_TSC_BUSY)) {
+        if (!mun_tsc_is_invariant())
+            return atomic_store(&mun_tsc.state, MUN_TSC_UNSUPPORTED), now;
+        mun_tsc.os_tsc = __rdtsc();
+        mun_tsc.os_usec = now;
+        atomic_store_explicit(&mun_tsc.state, MUN_TSC_CALIBRATING, memory_order_release);
+    } else if (state == MUN_TSC_CALIBRATING && now - mun_tsc.os_usec >= MUN_TSC_CALIBRATION
+            && atomic_compare_exchange_strong(&mun_tsc.state, &state, MUN_TSC_BUSY)) {
+        mun_tsc.rate = (double)(now - mun_tsc.os_usec) / (double)(__rdtsc() - mun_tsc.os_tsc);
+        mun_tsc.tsc = mun_tsc.os_tsc;
+        mun_tsc.usec = mun_tsc.os_usec;
+        atomic_store_explicit(&mun_tsc.state, MUN_TSC_READY, memory_order_release);
+    }
+    return now;
+}
+#else
+mun_usec mun_usec_monotonic(void) {
+    return mun_usec_monotonic_os();
+}
+#endif
+
 static _Thread_local struct mun_error mun_global_err;
 static _Thread_local struct mun_error *mun_global_eptr;
 
@@ -40,7 +40,9 @@ typedef int64_t mun_usec;
 mun_usec mun_usec_now(void);
 
 // The monotonic clock. Only the differences are meaningful, but it always moves forward
-// at a rate of one second per second.
+// at a rate of one second per second. With `-DMUN_TSC_CLOCK=1` on x86-64, this switches to
+// reading the TSC about a second after the first call, if the CPU has an invariant one,
+// and re-anchoring it to `clock_gettime` every second after that.
 mun_usec mun_usec_monotonic(void);
 
 struct mun_stackframe {
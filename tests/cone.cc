@@ -2,10 +2,13 @@
 #include <fenv.h>
 #include <math.h>
 #include <float.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 
 #include <stdexcept>
+#include <thread>
 
 static bool test_yield() {
     int v = 0;
@@ -26,6 +29,29 @@ static bool test_wait() {
     return c->wait(cone::rethrow) && ASSERT(v == 1, "%d != 1", v);
 }
 
+static bool test_spawn_n() {
+    std::vector<size_t> order;
+    auto f = [&](size_t i) { return [&, i]() { return order.push_back(i), cone::yield(); }; };
+    std::vector<decltype(f(0))> fs;
+    for (size_t i = 0; i < 100; i++)
+        fs.push_back(f(i));
+    // Half of the stacks should come from the cache, the rest from a new slab.
+    size_t prev = cone_stack_cache(100 * 200UL * 1024);
+    for (size_t i = 0; i < 50; i++)
+        cone::ref{fs[i]}; // blocks from a slab are not cached, so these must be separate
+    bool ok = cone::yield() && cone::yield();
+    auto cs = cone::ref::spawn_n(fs);
+    cone_stack_cache(prev);
+    for (size_t i = 0; i < 100 && ok; i += 2)
+        ok = cs[i]->wait(cone::rethrow);
+    cs.resize(50); // the rest are detached
+    for (size_t i = 1; i < 50 && ok; i += 2)
+        ok = cs[i]->wait(cone::rethrow);
+    for (size_t i = 0; ok && i < order.size(); i++)
+        ok = ASSERT(order[i] == (i < 50 ? i : i - 50), "ran out of order");
+    return ok && ASSERT(order.size() == 150, "%zu != 150", order.size());
+}
+
 static bool test_cancel() {
     int v = 0;
     cone::ref c = [&]() { return cone::yield() && (v++, true); };
@@ -70,6 +96,61 @@ static bool test_wait_no_rethrow() {
     return c->wait(cone::norethrow);
 }
 
+static bool test_switch_to() {
+    struct cone *self = ::cone;
+    int v = 0;
+    size_t ticks = 0;
+    bool stop = false;
+    cone::ref t = [&]() {
+        for (; !stop; ticks++)
+            if (!cone::yield())
+                return false;
+        return true;
+    };
+    cone::ref g = [&]() {
+        for (;; v++)
+            if (!self->switch_to())
+                return mun_errno == ECANCELED;
+    };
+    // The generator has not started yet, so this has to go through the loop once.
+    bool ok = g->switch_to() && ASSERT(v == 0, "%d != 0", v);
+    size_t start = ticks;
+    for (int i = 1; ok && i <= 100; i++)
+        ok = g->switch_to() && ASSERT(v == i, "%d != %d", v, i);
+    ok = ok && ASSERT(ticks - start <= 1, "%zu loop iterations for 100 switches", ticks - start);
+    cone::event e;
+    cone::ref w = [&]() { return e.wait(); };
+    ok = ok && cone::yield()
+            && ASSERT(!::cone->switch_to() && mun_errno == EDEADLK, "switched to self")
+            && ASSERT(!w->switch_to() && mun_errno == EINVAL, "switched to a coroutine waiting on an event");
+    g->cancel();
+    stop = true;
+    e.wake();
+    return g->wait(cone::rethrow) && t->wait(cone::rethrow) && w->wait(cone::rethrow) && ok;
+}
+
+static bool test_yield_to() {
+    struct cone *self = ::cone;
+    std::vector<int> order;
+    cone::ref g = [&]() {
+        if (cone_switch_to(nullptr) MUN_RETHROW)
+            return false;
+        for (int i = 0; i < 3; i++)
+            if (order.push_back(i), !self->switch_to())
+                return false;
+        // The caller of `yield_to` is still runnable, so sleeping gives control back to it.
+        return order.push_back(3), cone::sleep_for(1ms) && (order.push_back(5), true);
+    };
+    bool ok = cone::yield(); // now `g` is waiting in `switch_to`
+    for (int i = 0; i < 4 && ok; i++)
+        ok = g->yield_to();
+    order.push_back(4);
+    ok = ok && g->wait(cone::rethrow);
+    for (size_t i = 0; ok && i < order.size(); i++)
+        ok = ASSERT(order[i] == (int)i, "ran out of order");
+    return ok && ASSERT(order.size() == 6, "%zu != 6", order.size());
+}
+
 template <bool cancel>
 static bool test_sleep() {
     auto start = cone::time::clock::now();
@@ -88,6 +169,74 @@ static bool test_sleep() {
         && ASSERT(!cancel || (end - start) < 75ms, "slept too much");
 }
 
+static bool test_sleep_order() {
+    auto start = cone::time::clock::now() + 10ms;
+    std::vector<size_t> order;
+    std::vector<cone::ref> cs;
+    for (size_t i = 0; i < 200; i++)
+        cs.emplace_back([&, i]() { return cone::sleep(start + (i * 37 % 200) * 100us) && (order.push_back(i), true); });
+    if (!cone::yield())
+        return false;
+    for (size_t i = 0; i < 200; i += 3)
+        cs[i]->cancel();
+    bool ok = true;
+    for (size_t i = 0; i < 200; i++)
+        ok = (i % 3 ? cs[i]->wait(cone::rethrow) : !cs[i]->wait(cone::rethrow) && mun_errno == ECANCELED) && ok;
+    for (size_t i = 1; ok && i < order.size(); i++)
+        ok = ASSERT(order[i - 1] * 37 % 200 < order[i] * 37 % 200, "woke up out of order");
+    return ok && ASSERT(order.size() == 133, "%zu != 133", order.size());
+}
+
+static bool test_timer_slack() {
+    mun_usec prev = cone_timer_slack(20000);
+    struct cone_loop_stats a, b;
+    cone_loop_stats(&a);
+    auto start = cone::time::clock::now();
+    int i = 0;
+    bool ok = spawn_and_wait(10, [&]() {
+        auto t = start + ++i * 1ms;
+        return cone::sleep(t) && ASSERT(cone::time::clock::now() >= t, "woke up too early");
+    });
+    cone_loop_stats(&b);
+    cone_timer_slack(prev);
+    size_t wakeups = b.timer_wakeups - a.timer_wakeups, expiries = b.timer_expiries - a.timer_expiries;
+    return ok && ASSERT(expiries == 10, "%zu != 10", expiries)
+              && ASSERT(wakeups <= 2, "%zu wakeups for 10 timers 1ms apart", wakeups)
+              && INFO("%zu wakeups", wakeups);
+}
+
+static bool test_busy_poll() {
+    mun_usec prev = cone_busy_poll(1000);
+    struct cone_loop_stats a, b, c;
+    cone_loop_stats(&a);
+    bool ok = cone::sleep_for(5ms);
+    cone_loop_stats(&b);
+    // This makes the fd ready before the loop runs out of things to do, so the spin finds it.
+    int fds[2];
+    if (ok && !pipe(fds)) {
+        cone::ref r = [&]() { return !cone_iowait(fds[0], 0); };
+        ok = cone::yield() && write(fds[1], "x", 1) == 1 && r->wait(cone::rethrow);
+        close(fds[0]), close(fds[1]);
+    }
+    cone_loop_stats(&c);
+    cone_busy_poll(prev);
+    return ok && ASSERT(b.spin_misses > a.spin_misses, "did not spin before sleeping")
+              && ASSERT(b.spin_time - a.spin_time >= 500, "spun for only %lldus", (long long)(b.spin_time - a.spin_time))
+              && ASSERT(c.spin_hits > b.spin_hits, "spinning did not notice a ready fd")
+              && INFO("spun for %lldus", (long long)(c.spin_time - a.spin_time));
+}
+
+static bool test_now() {
+    mun_usec a = cone_now();
+    usleep(2000);
+    mun_usec b = cone_now();
+    if (!ASSERT(a == b, "cached clock changed within an iteration") || !cone::yield())
+        return false;
+    mun_usec c = cone_now();
+    return ASSERT(c - a >= 2000, "%lld < 2000", (long long)(c - a))
+        && ASSERT(c <= mun_usec_monotonic(), "cached clock is ahead");
+}
+
 static bool test_sleep_after_cancel() {
     ::cone->cancel();
     auto a = cone::time::clock::now();
@@ -100,6 +249,16 @@ static bool test_deadline() {
     return ASSERT(!cone::sleep_for(1ms) && mun_errno == ETIMEDOUT, "deadline did not trigger");
 }
 
+static bool test_deadline_unstored() {
+    mun_usec t = mun_usec_monotonic();
+    if (cone_deadline(::cone, t + 1000000) || cone_deadline(::cone, t) MUN_RETHROW)
+        return false;
+    bool ok = ASSERT(!cone::sleep_for(1ms) && mun_errno == ETIMEDOUT, "deadline did not trigger");
+    cone_complete(::cone, t);
+    cone_complete(::cone, t + 1000000);
+    return ok && cone::sleep_for(1ms);
+}
+
 static bool test_deadline_lifting() {
     ::cone->timeout(0us);
     return cone::sleep_for(1ms);
@@ -149,6 +308,31 @@ static bool test_mutex() {
     return a->wait(cone::rethrow) && b->wait(cone::rethrow) && ASSERT(last == 2, "%d != 2", last);
 }
 
+static bool test_local_event() {
+    int v = 0;
+    cone::local_event ev;
+    cone::ref _1 = [&]() { return ev.wait_if([&]() { return v == 0; }) && (v = 2, true); };
+    cone::ref _2 = [&]() { return ev.wait() && ASSERT(v == 2, "%d != 2", v); };
+    cone::ref _3 = [&]() { return !ev.wait() && ASSERT(mun_errno == ECANCELED, "not cancelled"); };
+    return cone::yield() && (_3->cancel(), cone::yield()) && (v = 1, ASSERT(ev.wake() == 2u, "not 2 waiters"))
+        && _1->wait(cone::rethrow) && _2->wait(cone::rethrow) && _3->wait(cone::rethrow)
+        && ASSERT(ev.wake() == 0u, "still waiting");
+}
+
+static bool test_local_mutex() {
+    int last = 0;
+    cone::local_mutex m;
+    cone::ref a = [&]() {
+        auto g = m.guard(cone::local_mutex::fair);
+        return cone::yield() && cone::yield() && (last = 1, true);
+    };
+    cone::ref b = [&]() { return !m.lock(cone::local_mutex::interruptible) && ASSERT(mun_errno == ECANCELED, "not cancelled"); };
+    cone::ref c = [&]() { return m.lock(), last = 2, m.unlock(), true; };
+    return cone::yield() && ASSERT(!m.try_lock(), "mutex not locked") && (b->cancel(), true)
+        && a->wait(cone::rethrow) && b->wait(cone::rethrow) && c->wait(cone::rethrow)
+        && ASSERT(last == 2, "%d != 2", last) && ASSERT(m.try_lock(), "mutex still locked") && (m.unlock(), true);
+}
+
 static bool test_exceptions_0() {
     cone::ref x = []() -> bool { throw std::runtime_error("<-- should preferably be demangled"); };
     return ASSERT(!x->wait(cone::rethrow), "x succeeded despite throwing") && INFO("%s", mun_last_error()->text);
@@ -195,7 +379,7 @@ namespace {
 
         ~fd() {
             if (i >= 0)
-                close(i);
+                cold_close(i);
         }
     };
 }
@@ -214,10 +398,13 @@ static bool test_yield_to_io() {
         && cone::yield() && cone::yield() && ASSERT(v == 1, "%d != 1", v);
 }
 
+template <bool registered>
 static bool test_rdwr() {
     fd fds[2];
     if (pipe((int*)fds) || cold_unblock(fds[0].i) || cold_unblock(fds[1].i) MUN_RETHROW_OS)
         return false;
+    if (registered && (cone_fd_register(fds[0].i) || cone_fd_register(fds[1].i) MUN_RETHROW))
+        return false;
     const char data[] = "Hello, World! Hello, World! Hello, World! Hello, World!";
     cone::ref r = [&, fd = fds[0].i]() {
         char buf[sizeof(data)];
@@ -238,6 +425,44 @@ static bool test_rdwr() {
     return r->wait(cone::rethrow) && w->wait(cone::rethrow);
 }
 
+static bool test_registered_fd_reuse() {
+    cone::ref p = []() {
+        fd fds[2];
+        if (pipe((int*)fds) || cone_fd_register(fds[0].i) MUN_RETHROW_OS)
+            return false;
+        return ASSERT(cone_pin(1), "registering an fd did not pin the coroutine");
+    };
+    if (!p->wait(cone::rethrow))
+        return false;
+    fd fds[2];
+    if (pipe((int*)fds) || cold_unblock(fds[0].i) MUN_RETHROW_OS)
+        return false;
+    cone::ref r = [&]() {
+        char c;
+        return ::cone->timeout(1s, [&]() { return cold_read(fds[0].i, &c, 1) == 1; });
+    };
+    return cone::yield() && ASSERT(write(fds[1].i, "x", 1) == 1, "write() failed") && r->wait(cone::rethrow);
+}
+
+static bool test_unpollable_fd_reuse() {
+    {
+        char path[] = "/tmp/cone-test-XXXXXX";
+        fd f;
+        if ((f.i = mkstemp(path)) < 0 MUN_RETHROW_OS)
+            return false;
+        unlink(path);
+        cone_iowait(f.i, CONE_IO_READ); // epoll fails with EPERM, others say it's ready
+    }
+    fd fds[2];
+    if (pipe((int*)fds) || cold_unblock(fds[0].i) MUN_RETHROW_OS)
+        return false;
+    cone::ref r = [&]() {
+        char c;
+        return ::cone->timeout(1s, [&]() { return cold_read(fds[0].i, &c, 1) == 1; });
+    };
+    return cone::yield() && ASSERT(write(fds[1].i, "x", 1) == 1, "write() failed") && r->wait(cone::rethrow);
+}
+
 static bool test_concurrent_rw() {
     fd fds[2];
     // don't bother with non-blocking mode, we'll `cone_iowait` directly.
@@ -255,6 +480,89 @@ static bool test_concurrent_rw() {
         && c->wait(cone::rethrow);
 }
 
+static bool test_exclusive_iowait() {
+    fd fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, (int*)fds) || cold_unblock(fds[0].i) MUN_RETHROW_OS)
+        return false;
+    int order = 0, wakeups = 0;
+    auto reader = [&](int i) {
+        return [&, i]() {
+            char c;
+            for (; read(fds[0].i, &c, 1) != 1; wakeups++)
+                if (cone_iowait(fds[0].i, CONE_IO_ONE) MUN_RETHROW)
+                    return false;
+            return order = order * 10 + i, true;
+        };
+    };
+    cone::ref a = reader(1);
+    cone::ref b = reader(2);
+    cone::ref c = reader(3);
+    return cone::yield()
+        && ASSERT(write(fds[1].i, "x", 1) == 1, "write() failed")
+        && a->wait(cone::rethrow) && cone::yield()
+        && ASSERT(order == 1 && wakeups == 1, "woken in order %d, %d times", order, wakeups)
+        && ASSERT(write(fds[1].i, "yz", 2) == 2, "write() failed")
+        && b->wait(cone::rethrow) && c->wait(cone::rethrow)
+        && ASSERT(order == 123, "woken in order %d", order);
+}
+
+static bool test_poll() {
+    fd a[2], b[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, (int*)a) || socketpair(AF_UNIX, SOCK_STREAM, 0, (int*)b) MUN_RETHROW_OS)
+        return false;
+    cone::event e;
+    struct cone_pollfd ps[] = {{a[0].i, CONE_IO_READ, NULL, 0}, {b[0].i, CONE_IO_READ, NULL, 0}, {-1, 0, &e, 0}};
+    auto poll = [&](mun_usec deadline) { return cone_poll(ps, 3, deadline); };
+    char c;
+    int r;
+    cone::ref w = [&]() { return cone::yield() && ASSERT(write(b[1].i, "x", 1) == 1, "write() failed"); };
+    if (!ASSERT((r = poll(MUN_USEC_MAX)) == 1 && !ps[0].ready && ps[1].ready && !ps[2].ready, "fd: %d %d%d%d", r, ps[0].ready, ps[1].ready, ps[2].ready)
+     || !w->wait(cone::rethrow) || !ASSERT(read(b[0].i, &c, 1) == 1, "read() failed"))
+        return false;
+    w = [&]() { return cone::yield() && ASSERT(e.wake() == 1, "poll not waiting on the event"); };
+    return ASSERT((r = poll(MUN_USEC_MAX)) == 1 && !ps[0].ready && !ps[1].ready && ps[2].ready, "event: %d %d%d%d", r, ps[0].ready, ps[1].ready, ps[2].ready)
+        && w->wait(cone::rethrow)
+        && ASSERT((r = poll(cone_now() + 10000)) == 0 && !ps[0].ready && !ps[1].ready && !ps[2].ready, "timeout: %d", r)
+        && ASSERT(e.wake() == 0, "poll still waiting on the event");
+}
+
+static bool test_file_io() {
+    char path[] = "/tmp/cone-test-XXXXXX";
+    int tmp = mkstemp(path);
+    if (tmp < 0 || close(tmp) MUN_RETHROW_OS)
+        return false;
+    fd f;
+    f.i = cold_openat(AT_FDCWD, path, O_RDWR, 0);
+    unlink(path);
+    char buf[6] = {};
+    #ifdef __linux__
+        struct statx st;
+    #endif
+    return ASSERT(f.i >= 0, "openat() failed with %d", errno)
+        && ASSERT(cold_pwrite(f.i, "abcdef", 6, 0) == 6, "pwrite() failed with %d", errno)
+        && ASSERT(cold_fsync(f.i) == 0, "fsync() failed with %d", errno)
+    #ifdef __linux__
+        && ASSERT(cold_statx(f.i, "", AT_EMPTY_PATH, STATX_SIZE, &st) == 0, "statx() failed with %d", errno)
+        && ASSERT(st.stx_size == 6, "file size is %llu, not 6", (unsigned long long)st.stx_size)
+    #endif
+        && ASSERT(cold_pread(f.i, buf, 3, 3) == 3 && !memcmp(buf, "def", 3), "pread() returned wrong data")
+        && ASSERT(cold_read(f.i, buf, 6) == 6 && !memcmp(buf, "abcdef", 6), "read() returned wrong data");
+}
+
+#if CONE_EV_URING
+static bool test_ioring_timeout() {
+    fd fds[2];
+    if (pipe((int*)fds) MUN_RETHROW_OS)
+        return false;
+    // Blocking fds go to the ring, so a timed out read must be cancelled, not left to eat the byte.
+    char c = 0;
+    return ASSERT(::cone->timeout(10ms, [&]() { return cold_read(fds[0].i, &c, 1); }) < 0, "read() did not time out")
+        && ASSERT(errno == ETIMEDOUT, "unexpected error %d", errno)
+        && ASSERT(write(fds[1].i, "x", 1) == 1, "write() failed")
+        && ASSERT(cold_read(fds[0].i, &c, 1) == 1 && c == 'x', "read() did not get the byte");
+}
+#endif
+
 template <size_t n>
 static bool test_many_fds() {
     fd fds[n * 2];
@@ -305,6 +613,16 @@ static bool test_thread() {
     )->wait(cone::rethrow) && ASSERT(v == 1, "%d != 1", v);
 }
 
+static bool test_outside_loop() {
+    bool ok = false;
+    std::thread([&]() {
+        struct cone_loop_stats st;
+        cone_loop_stats(&st);
+        ok = !cone_count() && !cone_stack_cache(0) && !cone_timer_slack(1000) && !cone_busy_poll(1000) && !st.wakeups;
+    }).join();
+    return ASSERT(ok, "loop settings not ignored on a thread without a loop");
+}
+
 static bool test_mt_mutex() {
     size_t r = 0;
     cone::mutex m;
@@ -319,6 +637,95 @@ static bool test_mt_mutex() {
     }) && ASSERT(r == 4 * 100 * 10000, "%zu != %d", r, 4 * 100 * 10000);
 }
 
+static bool test_group() {
+    struct cone_group *g = cone_group(4, CONE_GROUP_STEAL, &cone::thread::start);
+    if (!ASSERT(g, "could not create a group"))
+        return false;
+    std::atomic<size_t> moved{0}, pinned_moved{0};
+    std::vector<cone::ref> cs;
+    // Everything starts on one loop, and the unpinned ones keep it busy until at least one
+    // of them ends up elsewhere, however long the other threads take to start.
+    auto deadline = cone::time::clock::now() + 5s;
+    for (size_t i = 0; i < 100; i++) cs.emplace_back(g, 0, [&, pin = i % 2]() {
+        cone_pin(pin);
+        for (size_t j = 0; j < 100 || (!pin && !moved && cone::time::clock::now() < deadline); j++) {
+            auto home = cone_count();
+            if (!cone::yield())
+                return false;
+            if (home != cone_count())
+                (pin ? pinned_moved : moved)++;
+        }
+        return true;
+    });
+    bool ok = true;
+    for (auto& c : cs)
+        ok = c->wait(cone::rethrow) && ok;
+    cs.clear();
+    cone_group_join(g);
+    return ok && ASSERT(pinned_moved == 0, "%zu moves of pinned coroutines", pinned_moved.load())
+              && ASSERT(moved != 0, "no coroutines were moved")
+              && INFO("%zu moves", moved.load());
+}
+
+static bool test_pool() {
+    cone::pool p(4, CONE_GROUP_PIN);
+    const std::atomic<unsigned>* loops[8];
+    std::atomic<size_t> started{0};
+    std::atomic<bool> done{false};
+    std::vector<cone::ref> cs;
+    for (size_t i = 0; i < 8; i++) cs.push_back(p.spawn_balanced([&]() {
+        loops[started++] = cone::count();
+        while (!done)
+            if (!cone::sleep_for(1ms))
+                return false;
+        return true;
+    }));
+    while (started != 8)
+        if (!cone::sleep_for(1ms))
+            return false;
+    done = true;
+    bool ok = true;
+    for (auto& c : cs)
+        ok = c->wait(cone::rethrow) && ok;
+    std::sort(loops, loops + 8);
+    for (size_t i = 0; i < 8; i++)
+        ok = ok && ASSERT(loops[i] == loops[i / 2 * 2] && (i % 2 || !i || loops[i] != loops[i - 1]), "not 2 coroutines per loop");
+    return ok;
+}
+
+static bool test_pool_outside_loop() {
+    std::atomic<size_t> ran{0};
+    std::thread([&]() {
+        cone::pool p(2);
+        for (unsigned i = 0; i < 4; i++)
+            p.spawn(i, [&]() { return cone::sleep_for(10ms) && (ran++, true); });
+    }).join();
+    return ASSERT(ran == 4, "%zu of 4 coroutines finished before the pool was destroyed", ran.load());
+}
+
+static bool test_listener() {
+    cone::pool p(2);
+    std::atomic<size_t> served{0};
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    cone::listener l{p, (sockaddr*)&addr, sizeof(addr), 16, [&](int fd) {
+        served++;
+        return cold_write(fd, "x", 1) == 1 && !cold_close(fd);
+    }};
+    if (!l MUN_RETHROW)
+        return false;
+    for (size_t i = 0; i < 16; i++) {
+        fd c;
+        char buf;
+        if ((c.i = socket(AF_INET, SOCK_STREAM, 0)) < 0 || cold_connect(c.i, l.address(), l.address_size()) MUN_RETHROW_OS)
+            return false;
+        if (!ASSERT(cold_read(c.i, &buf, 1) == 1, "read() failed"))
+            return false;
+    }
+    return ASSERT(served == 16, "%zu connections served", served.load());
+}
+
 static bool test_mguard() {
     cone::mguard g;
     if (!ASSERT(g.active() == 0, "@0"))
@@ -347,36 +754,84 @@ static bool test_sse2_csr() {
     return _1->wait(cone::rethrow);
 }
 
+static int use_stack(void *) {
+    volatile char buf[16384];
+    buf[0] = 0;
+    return buf[0];
+}
+
+static bool test_stack_usage() {
+    int restore = cone_stack_track(1);
+    struct cone *c = cone_spawn(65536, cone_bind(&use_stack, nullptr));
+    cone_stack_track(restore);
+    if (!ASSERT(c, "spawn failed") || cone_join(c, CONE_RETHROW) MUN_RETHROW)
+        return false;
+    struct cone_stack_usage u[16];
+    size_t n = cone_stack_usage(u, 16), i = 0;
+    while (i < n && i < 16 && u[i].code != &use_stack) i++;
+    return ASSERT(i < n && i < 16, "no statistics for the spawned function")
+        && ASSERT(u[i].count == 1, "%zu != 1", u[i].count)
+        && ASSERT(u[i].max >= 16384 && u[i].max < 32768, "%zu not in [16k, 32k)", u[i].max)
+        && ASSERT(u[i].hist[5] == 1, "deepest point in the wrong bin")
+        && ASSERT(u[i].suggest < u[i].stack, "%zu >= %zu", u[i].suggest, u[i].stack)
+        && INFO("max %zu of %zu bytes, suggested %zu", u[i].max, u[i].stack, u[i].suggest);
+}
+
 export {
     { "cone:yield", &test_yield },
     { "cone:detach", &test_detach },
     { "cone:wait", &test_wait },
+    { "cone:spawn many at once", &test_spawn_n },
     { "cone:wait on cancelled", &test_cancel },
     { "cone:wait on cancelled, but atomic", &test_cancel_atomic },
     { "cone:wait on cancelled, but uninterruptible", &test_cancel_uninterruptible },
     { "cone:wait on cancelled before sleeping", &test_cancel_sleeping },
     { "cone:wait on cancelled by scope guard", &test_cancel_by_guard },
     { "cone:wait(rethrow=false)", &test_wait_no_rethrow },
+    { "cone:switch to another coroutine", &test_switch_to },
+    { "cone:yield to another coroutine", &test_yield_to },
     { "cone:sleep 50ms concurrent with 100ms", &test_sleep<false> },
     { "cone:sleep 50ms concurrent with cancelled 100ms", &test_sleep<true> },
+    { "cone:sleep in order", &test_sleep_order },
+    { "cone:sleep with slack", &test_timer_slack },
+    { "cone:sleep after busy polling", &test_busy_poll },
+    { "cone:now", &test_now },
     { "cone:sleep while handling cancellation", &test_sleep_after_cancel },
     { "cone:deadline", &test_deadline },
+    { "cone:deadline without storage", &test_deadline_unstored },
     { "cone:deadline lifting", &test_deadline_lifting },
     { "cone:deadline at never", &test_deadline_nop },
     { "cone:count", &test_count },
     { "cone:event", &test_event },
     { "cone:event.wake(1)", &test_event_wake },
     { "cone:mutex", &test_mutex },
+    { "cone:local event", &test_local_event },
+    { "cone:local mutex", &test_local_mutex },
     { "cone:throw", &test_exceptions_0 },
     { "cone:throw and unwind", &test_exceptions_1 },
     { "cone:throw and throw again", &test_exceptions_2 },
     { "cone:yield to reader", &test_yield_to_io },
-    { "cone:reader + writer", &test_rdwr },
+    { "cone:reader + writer", &test_rdwr<false> },
+    { "cone:reader + writer, registered fds", &test_rdwr<true> },
+    { "cone:registered fd reuse", &test_registered_fd_reuse },
+    { "cone:unpollable fd reuse", &test_unpollable_fd_reuse },
     { "cone:reader + writer on one fd", &test_concurrent_rw },
+    { "cone:exclusive i/o waits", &test_exclusive_iowait },
+    { "cone:poll", &test_poll },
+    { "cone:file i/o", &test_file_io },
+#if CONE_EV_URING
+    { "cone:io_uring read timeout", &test_ioring_timeout },
+#endif
     { "cone:many fds", &test_many_fds<120> },
     { "cone:io starvation", &test_io_starvation },
     { "cone:thread", &test_thread },
+    { "cone:outside a loop", &test_outside_loop },
     { "cone:threads and a mutex", &test_mt_mutex },
+    { "cone:group", &test_group },
+    { "cone:pool", &test_pool },
+    { "cone:pool outside a loop", &test_pool_outside_loop },
+    { "cone:sharded listener", &test_listener },
     { "cone:mguard", &test_mguard },
     { "cone:sse2 csr", &test_sse2_csr },
+    { "cone:stack usage", &test_stack_usage },
 };
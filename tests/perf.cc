@@ -1,5 +1,6 @@
 #include "base.cc"
 #include <mutex>
+#include <sys/resource.h>
 
 #include "../cold.h"
 
@@ -47,19 +48,60 @@ static bool test_yield() {
     });
 }
 
+template <size_t cache>
 static bool test_spawn() {
-    return measure([](size_t cones) {
+    size_t prev = cone_stack_cache(cache);
+    bool ok = measure([](size_t cones) {
         for (size_t i = 0; i < cones; i++)
             if (!cone::ref{[](){ return true; }}->wait(cone::rethrow) MUN_RETHROW)
                 return false;
         return true;
     });
+    return cone_stack_cache(prev), ok;
+}
+
+template <typename F>
+static int invoke_heap(void *f) {
+    return (*std::unique_ptr<F>(reinterpret_cast<F*>(f)))() ? 0 : -1;
+}
+
+// What `cone::ref` used to do: allocate the closure separately from the coroutine.
+static bool test_spawn_heap() {
+    return measure([](size_t cones) {
+        for (size_t i = 0; i < cones; i++) {
+            auto f = []() { return true; };
+            cone::ref c;
+            c.reset(cone_spawn(100UL * 1024, cone_bind(&invoke_heap<decltype(f)>, new decltype(f)(f))));
+            if (!c->wait(cone::rethrow) MUN_RETHROW)
+                return false;
+        }
+        return true;
+    });
 }
 
 static bool test_spawn_many() {
     return measure([](size_t cones) { return spawn_and_wait(cones, []() { return true; }); });
 }
 
+template <size_t n, bool batch>
+static bool test_fan_out() {
+    return measure([](size_t rounds) {
+        auto f = []() { return true; };
+        std::vector<decltype(f)> fs(n, f);
+        for (size_t r = 0; r < rounds; r++) {
+            std::vector<cone::ref> cs;
+            if (batch)
+                cs = cone::ref::spawn_n(fs);
+            else for (auto& f : fs)
+                cs.emplace_back(f);
+            for (auto& c : cs)
+                if (!c->wait(cone::rethrow) MUN_RETHROW)
+                    return false;
+        }
+        return true;
+    });
+}
+
 template <size_t ratio>
 static bool test_spawn_many_yielding() {
     return measure2<ratio>([](size_t cones, size_t yields_per_cone) {
@@ -72,14 +114,50 @@ static bool test_spawn_many_yielding() {
     });
 }
 
-template <size_t ratio>
+template <typename E>
+static bool test_ping_pong() {
+    return measure([](size_t n) {
+        E e[2];
+        size_t turn = 0;
+        auto player = [&](size_t k) {
+            return [&, k]() {
+                for (size_t i = 0; i < n; i++) {
+                    if (!e[k].wait_if([&]() { return turn % 2 != k; }) MUN_RETHROW)
+                        return false;
+                    turn++;
+                    e[!k].wake();
+                }
+                return true;
+            };
+        };
+        cone::ref a = player(0);
+        cone::ref b = player(1);
+        return a->wait(cone::rethrow) && b->wait(cone::rethrow);
+    });
+}
+
+static bool test_switch_to() {
+    return measure([](size_t n) {
+        struct cone *a = ::cone;
+        cone::ref b = [&]() {
+            while (a->switch_to()) {}
+            return mun_errno == ECANCELED;
+        };
+        for (size_t i = 0; i < n; i++)
+            if (!b->switch_to() MUN_RETHROW)
+                return false;
+        return b->cancel(), b->wait(cone::rethrow);
+    });
+}
+
+template <size_t ratio, typename M>
 static bool test_mutex() {
     return measure2<ratio>([&](size_t cones, size_t yields_per_cone) {
         size_t r = 0;
-        cone::mutex m;
+        M m;
         return spawn_and_wait(cones, [&]() {
             for (size_t n = yields_per_cone; n--;) {
-                std::unique_lock<cone::mutex> g(m);
+                std::unique_lock<M> g(m);
                 size_t c = r;
                 if (!cone::yield() MUN_RETHROW)
                     return false;
@@ -90,6 +168,38 @@ static bool test_mutex() {
     });
 }
 
+static std::atomic<size_t> moves{0};
+
+static bool work() {
+    for (size_t j = 0; j < 10; j++) {
+        volatile size_t x = 0;
+        for (size_t k = 0; k < 10000; k++)
+            x = x + k;
+        auto home = cone::count();
+        if (!cone::yield() MUN_RETHROW)
+            return false;
+        if (home != cone::count())
+            moves++;
+    }
+    return true;
+}
+
+// If not `balanced`, all work starts on one loop of the pool; without stealing, the
+// others stay idle.
+template <unsigned threads, int flags, bool balanced>
+static bool test_pool() {
+    moves = 0;
+    return measure([](size_t cones) {
+        cone::pool p(threads, flags);
+        std::vector<cone::ref> cs;
+        for (size_t i = 0; i < cones; i++) cs.push_back(balanced ? p.spawn_balanced(&work) : p.spawn(0, &work));
+        bool ok = true;
+        for (auto& c : cs)
+            ok = c->wait(cone::rethrow) && ok;
+        return ok;
+    }) && ASSERT(!(flags & CONE_GROUP_STEAL) == !moves, "%zu coroutines moved", moves.load());
+}
+
 template <size_t threads, size_t ratio, typename M>
 static bool test_mt_mutex() {
     return measure2<ratio>([&](size_t iters, size_t cones) {
@@ -108,7 +218,102 @@ static bool test_mt_mutex() {
     });
 }
 
-template <size_t n>
+// Each round, `n` coroutines on `threads` other threads report that they are about to wait,
+// and this one wakes all of them with a single call.
+template <size_t threads, size_t n>
+static bool test_broadcast() {
+    return measure([](size_t rounds) {
+        cone::event go, ready;
+        std::atomic<size_t> round{0}, waiting{0};
+        cone::ref c = [&]() {
+            return spawn_and_wait<cone::thread>(threads, [&]() {
+                return spawn_and_wait(n / threads, [&]() {
+                    for (size_t r = 0; r < rounds; r++) {
+                        if (++waiting % n == 0)
+                            ready.wake();
+                        if (!go.wait_if([&]() { return round <= r; }) MUN_RETHROW)
+                            return false;
+                    }
+                    return true;
+                });
+            });
+        };
+        for (size_t r = 0; r < rounds; r++) {
+            if (!ready.wait_if([&]() { return waiting < n * (r + 1); }) MUN_RETHROW)
+                return false;
+            round++;
+            go.wake();
+        }
+        return c->wait(cone::rethrow);
+    });
+}
+
+// Keep about `n` timers pending for as long as the returned coroutines exist: `n / 1000`
+// of them, each with 1000 deadlines, sleeping until cancelled.
+static std::vector<cone::guard> pending_timers(size_t n) {
+    std::vector<cone::guard> cs;
+    for (size_t i = 0; i < n / 1000; i++) cs.emplace_back([i]() {
+        mun_usec t = mun_usec_monotonic() + 3600000000ull + i * 1000;
+        size_t j = 0;
+        while (j < 1000 && !cone_deadline(cone, t + j))
+            j++;
+        bool ok = j == 1000 && cone::sleep_for(std::chrono::hours(2));
+        while (j--)
+            cone_complete(cone, t + j);
+        return ok;
+    }, 16384UL);
+    return cs;
+}
+
+template <size_t timers>
+static bool test_deadline() {
+    auto _ = pending_timers(timers);
+    return cone::yield() && measure([](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            auto d = cone->timeout(std::chrono::hours(1));
+            if (!cone::yield() MUN_RETHROW)
+                return false;
+        }
+        return true;
+    });
+}
+
+// `cone_deadline` has to allocate a timer and find it again in `cone_complete`, while
+// `cone_deadline_set` uses the caller's storage. Both get the same precomputed time.
+template <bool allocated>
+static bool test_deadline_nop() {
+    return measure([](size_t n) {
+        mun_usec t = mun_usec_monotonic() + 3600000000ull;
+        for (size_t i = 0; i < n; i++) {
+            if (allocated) {
+                if (cone_deadline(cone, t) MUN_RETHROW)
+                    return false;
+                cone_complete(cone, t);
+            } else {
+                cone_timer tm;
+                if (cone_deadline_set(cone, &tm, t) MUN_RETHROW)
+                    return false;
+                cone_deadline_clear(&tm);
+            }
+        }
+        return true;
+    });
+}
+
+template <size_t timers>
+static bool test_sleep_cancel() {
+    auto _ = pending_timers(timers);
+    return cone::yield() && measure([](size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            cone::guard c{[]() { return cone::sleep_for(std::chrono::hours(1)); }};
+            if (!cone::yield() MUN_RETHROW)
+                return false;
+        }
+        return true;
+    });
+}
+
+template <size_t n, bool registered = false>
 static bool test_io() {
     return measure([&](size_t m) {
         std::vector<cone::guard> cs(n*2);
@@ -118,12 +323,14 @@ static bool test_io() {
                 return false;
             if (cold_unblock(fds[0]) || cold_unblock(fds[1]) MUN_RETHROW_OS)
                 return close(fds[0]), close(fds[1]), false;
+            if (registered && (cone_fd_register(fds[0]) || cone_fd_register(fds[1]) MUN_RETHROW))
+                return cold_close(fds[0]), cold_close(fds[1]), false;
             cs[i*2+0] = [&, fd = fds[0]]() {
                 char buf[1024];
                 while (true) {
                     int ret = cold_read(fd, buf, sizeof(buf));
-                    if (ret < 0 MUN_RETHROW_OS) return close(fd), false;
-                    if (ret == 0) return close(fd), true;
+                    if (ret < 0 MUN_RETHROW_OS) return cold_close(fd), false;
+                    if (ret == 0) return cold_close(fd), true;
                 }
             };
             cs[i*2+1] = [&, fd = fds[1]]() {
@@ -132,11 +339,11 @@ static bool test_io() {
                 for (size_t i = 0; i < m; i++) {
                     for (size_t o = 0; o < size; ) {
                         int ret = cold_write(fd, data + o, size - o);
-                        if (ret < 0 MUN_RETHROW_OS) return close(fd), false;
+                        if (ret < 0 MUN_RETHROW_OS) return cold_close(fd), false;
                         o += ret;
                     }
                 }
-                return close(fd), true;
+                return cold_close(fd), true;
             };
         }
         for (cone::guard &c : cs)
@@ -146,15 +353,89 @@ static bool test_io() {
     });
 }
 
+// Every iteration, all `n` readers block on their own sockets and are then woken at once,
+// so the loop's set of fds with waiters swings between empty and `n` entries.
+template <size_t n>
+static bool test_many_fds() {
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) MUN_RETHROW_OS)
+        return false;
+    if (lim.rlim_cur < n * 2 + 64) {
+        lim.rlim_cur = std::min<rlim_t>(lim.rlim_max, n * 2 + 64);
+        if (lim.rlim_cur < n * 2 + 64 || setrlimit(RLIMIT_NOFILE, &lim))
+            return INFO("skipped, RLIMIT_NOFILE is at most %llu", (unsigned long long)lim.rlim_max);
+    }
+    std::vector<int> fds;
+    auto closer = [](std::vector<int> *v) { for (int fd : *v) cold_close(fd); };
+    std::unique_ptr<std::vector<int>, decltype(closer)> _(&fds, closer);
+    for (size_t i = 0; i < n; i++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) MUN_RETHROW_OS)
+            return false;
+        fds.insert(fds.end(), pair, pair + 2);
+        if (cold_unblock(pair[0]) MUN_RETHROW_OS)
+            return false;
+    }
+    return measure([&](size_t m) {
+        size_t done = 0;
+        cone::event all;
+        std::vector<cone::guard> cs;
+        cs.reserve(n);
+        for (size_t i = 0; i < n; i++) cs.emplace_back([&, fd = fds[i*2]]() {
+            char c;
+            for (size_t j = 0; j < m; j++) {
+                if (cold_read(fd, &c, 1) != 1 MUN_RETHROW_OS)
+                    return false;
+                if (++done == n)
+                    all.wake();
+            }
+            return true;
+        }, 16384UL);
+        for (size_t j = 0; j < m; j++, done = 0) {
+            for (size_t i = 0; i < n; i++)
+                if (write(fds[i*2+1], "x", 1) != 1 MUN_RETHROW_OS)
+                    return false;
+            if (!all.wait() MUN_RETHROW)
+                return false;
+        }
+        for (auto& c : cs)
+            if (!c->wait(cone::rethrow) MUN_RETHROW)
+                return false;
+        return true;
+    });
+}
+
 export {
     { "perf:yield/N", &test_yield },
-    { "perf:(spawn(nop), wait, drop)/N", &test_spawn },
+    { "perf:(spawn(nop), wait, drop)/N", &test_spawn<CONE_STACK_CACHE> },
+    { "perf:(spawn(nop), wait, drop)/N (no stack cache)", &test_spawn<0> },
+    { "perf:(spawn(nop), wait, drop)/N (closure on heap)", &test_spawn_heap },
     { "perf:spawn(nop)/N, wait/N, drop/N", &test_spawn_many },
+    { "perf:(spawn(nop)/1k, wait/1k, drop/1k)/N", &test_fan_out<1000, false> },
+    { "perf:(spawn(nop)/1k at once, wait/1k, drop/1k)/N", &test_fan_out<1000, true> },
     { "perf:spawn(yield/N)/1kN, wait/1kN, drop/1kN", &test_spawn_many_yielding<1000> },
-    { "perf:spawn((lock, yield, unlock)/N)/200N, wait/200N, drop/200N", &test_mutex<200> },
+    { "perf:(wake, wait)/N x 2 coroutines", &test_ping_pong<cone::event> },
+    { "perf:(wake, wait)/N x 2 coroutines (cone::local_event)", &test_ping_pong<cone::local_event> },
+    { "perf:(switch_to)/N x 2 coroutines", &test_switch_to },
+    { "perf:spawn((lock, yield, unlock)/N)/200N, wait/200N, drop/200N", &test_mutex<200, cone::mutex> },
+    { "perf:spawn((lock, yield, unlock)/N)/200N, wait/200N, drop/200N (cone::local_mutex)", &test_mutex<200, cone::local_mutex> },
     { "perf:8 threads:spawn((lock, inc, unlock)/10N)/N (cone::mutex)", &test_mt_mutex<8, 10, cone::mutex> },
     { "perf:8 threads:spawn((lock, inc, unlock)/10N)/N (std::mutex)", &test_mt_mutex<8, 10, std::mutex> },
     { "perf:8 threads:spawn((lock, inc, unlock)/100kN)/N (cone::mutex)", &test_mt_mutex<8, 100000, cone::mutex> },
     { "perf:8 threads:spawn((lock, inc, unlock)/100kN)/N (std::mutex)", &test_mt_mutex<8, 100000, std::mutex> },
+    { "perf:(wake 10k on another thread)/N", &test_broadcast<1, 10000> },
+    { "perf:(wake 10k on 4 other threads)/N", &test_broadcast<4, 10000> },
+    { "perf:4 threads:spawn(10 x (10k adds, yield))/N on one", &test_pool<4, 0, false> },
+    { "perf:4 threads:spawn(10 x (10k adds, yield))/N on one (stealing)", &test_pool<4, CONE_GROUP_STEAL, false> },
+    { "perf:4 threads:spawn(10 x (10k adds, yield))/N balanced", &test_pool<4, 0, true> },
+    { "perf:4 threads:spawn(10 x (10k adds, yield))/N balanced (pinned)", &test_pool<4, CONE_GROUP_PIN, true> },
+    { "perf:(deadline_set, deadline_clear)/N", &test_deadline_nop<false> },
+    { "perf:(deadline, complete)/N (allocated)", &test_deadline_nop<true> },
+    { "perf:(deadline, yield, complete)/N", &test_deadline<0> },
+    { "perf:(deadline, yield, complete)/N with 1M timers pending", &test_deadline<1000000> },
+    { "perf:(spawn(sleep), yield, cancel, wait)/N with 1M timers pending", &test_sleep_cancel<1000000> },
     { "perf:spawn(read/*)/100, spawn(write/N)/100, wait/200", &test_io<100> },
+    { "perf:spawn(read/*)/100, spawn(write/N)/100, wait/200 (registered fds)", &test_io<100, true> },
+    { "perf:(write/5k, wake 5k readers)/N, 10k fds", &test_many_fds<5000> },
+    { "perf:(write/50k, wake 50k readers)/N, 100k fds", &test_many_fds<50000> },
 };